@@ -0,0 +1,90 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <linux/mempolicy.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+namespace cortisol {
+
+static const size_t cache_line_size = 64;
+
+/** The NUMA node this thread's cache_aligned objects should live on, or -1 for wherever (see Placement). */
+inline int &alloc_node() {
+    static thread_local int node = -1;
+    return node;
+}
+
+/** Asks for pages [p, p + len) to be placed on node, if they aren't yet.  Best effort: without NUMA this does nothing. */
+inline void prefer_node(void *p, size_t len, int node) {
+    unsigned long mask[16] = {0};
+    const size_t bits = 8 * sizeof mask[0];
+    if (node < 0 || static_cast<size_t>(node) >= bits * 16) {
+        return;
+    }
+    mask[node / bits] = 1UL << (node % bits);
+    syscall(SYS_mbind, p, len, MPOL_PREFERRED, mask, bits * 16, 0);
+}
+
+/**
+ * Base for objects that must start on their own cache line.  Before C++17,
+ * plain new ignores alignas() beyond the default alignment, so this does
+ * the allocation itself.
+ *
+ * If the allocating thread has an alloc_node(), the object gets pages of
+ * its own, bound to that node before they're first touched.  Either way
+ * its first cache line says which: 0, or the length of the mapping.
+ */
+class cache_aligned {
+  public:
+    static void *operator new(size_t sz) {
+        const size_t total = sz + cache_line_size;
+        void *p;
+        const int node = alloc_node();
+        if (node >= 0) {
+            const size_t page = sysconf(_SC_PAGESIZE);
+            const size_t len = (total + page - 1) / page * page;
+            p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            prefer_node(p, len, node);
+            *static_cast<size_t *>(p) = len;
+        } else {
+            if (posix_memalign(&p, cache_line_size, total) != 0) {
+                throw std::bad_alloc();
+            }
+            *static_cast<size_t *>(p) = 0;
+        }
+        return static_cast<char *>(p) + cache_line_size;
+    }
+    static void operator delete(void *q) {
+        if (q == NULL) {
+            return;
+        }
+        void *p = static_cast<char *>(q) - cache_line_size;
+        const size_t len = *static_cast<size_t *>(p);
+        if (len != 0) {
+            munmap(p, len);
+        } else {
+            free(p);
+        }
+    }
+};
+
+/**
+ * Adds n to a counter that only one thread writes.  A relaxed load and
+ * store is enough, and avoids the locked read-modify-write of operator+=.
+ */
+template<typename T>
+inline void bump(std::atomic<T> &x, T n = 1) {
+    x.store(x.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+} // namespace cortisol
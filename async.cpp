@@ -0,0 +1,604 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "async.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <stdexcept>
+#include <utility>
+
+#include "placement.h"
+#include "timing.h"
+#include "wire.h"
+
+namespace cortisol {
+
+using std::cerr;
+using std::endl;
+
+using mongo::BSONObj;
+
+void PipelineBackend::insert(const string &ns, const vector<BSONObj> &docs) {
+    _last_ns = ns;
+    wire::Builder b(wire::op_insert, next_id(), 0);
+    b.int32(0);
+    b.cstring(ns);
+    for (auto it = docs.begin(); it != docs.end(); ++it) {
+        b.doc(*it);
+    }
+    out += b.finish();
+}
+
+void PipelineBackend::update(const string &ns, const BSONObj &query, const BSONObj &update) {
+    _last_ns = ns;
+    wire::Builder b(wire::op_update, next_id(), 0);
+    b.int32(0);
+    b.cstring(ns);
+    b.int32(0);
+    b.doc(query);
+    b.doc(update);
+    out += b.finish();
+}
+
+void PipelineBackend::remove(const string &ns, const BSONObj &query, bool just_one) {
+    _last_ns = ns;
+    wire::Builder b(wire::op_delete, next_id(), 0);
+    b.int32(0);
+    b.cstring(ns);
+    b.int32(just_one ? wire::delete_single : 0);
+    b.doc(query);
+    out += b.finish();
+}
+
+uint64_t PipelineBackend::ack(WriteConcern wc) {
+    if (wc == WriteConcern::unacknowledged) {
+        return 0;
+    }
+    Pending p;
+    p.request_id = next_id();
+    p.batch_size = 0;
+    p.limit = 0;
+    p.returned = 0;
+    wire::Builder b(wire::op_query, p.request_id, 0);
+    b.int32(0);
+    b.cstring(_last_ns.substr(0, _last_ns.find('.')) + ".$cmd");
+    b.int32(0);
+    b.int32(-1);
+    b.doc(getlasterror_command(wc));
+    out += b.finish();
+    pending.push_back(p);
+    return 1;
+}
+
+uint64_t PipelineBackend::query(const string &ns, const BSONObj &query, const ReadOptions &opts, const std::function<void(const BSONObj&)> &f) {
+    // Exhaust cursors are read with getMores like any other.
+    Pending p;
+    p.request_id = next_id();
+    p.ns = ns;
+    p.batch_size = opts.batch_size;
+    p.limit = opts.exhaust ? 0 : opts.limit;
+    p.returned = 0;
+    wire::Builder b(wire::op_query, p.request_id, 0);
+    b.int32(0);
+    b.cstring(ns);
+    b.int32(0);
+    b.int32(p.limit > 0 ? p.limit : p.batch_size);
+    b.doc(query);
+    if (opts.fields != NULL) {
+        b.doc(*opts.fields);
+    }
+    out += b.finish();
+    pending.push_back(p);
+    return 0;
+}
+
+size_t AsyncEngine::workers = 4;
+po::options_description AsyncEngine::options_description() {
+    po::options_description desc("Async Engine");
+    desc.add_options()
+            ("async.workers", po::value(&workers)->default_value(workers), "# of threads driving the runners with --engine=async.")
+            ;
+    return desc;
+}
+
+/** One runner, as a virtual client with its own connection. */
+class AsyncClient {
+  public:
+    enum State {
+        disconnected,
+        connecting,
+        idle,
+        busy    // an op is in flight
+    };
+
+    CollectionRunner *runner;
+    State state;
+    int fd;
+    bool want_write;     // registered for EPOLLOUT
+    string out;
+    size_t out_pos;
+    string in;
+    int32_t next_id;
+    PipelineBackend backend;
+    timestamp_t wake;    // when the timer for this client is set for, 0 if none
+    timestamp_t intended;
+    timestamp_t t0;
+    uint64_t docs;
+    uint64_t bytes;
+    bool ok;
+    double backoff;
+
+    explicit AsyncClient(CollectionRunner *r) : runner(r), state(disconnected), fd(-1), want_write(false), out_pos(0), next_id(1), backend(next_id), wake(0), intended(0), t0(0), docs(0), bytes(0), ok(true), backoff(0) {}
+};
+
+/** A thread's share of an AsyncEngine's runners, and its epoll loop. */
+class AsyncWorker {
+    typedef std::pair<timestamp_t, AsyncClient *> timer;
+
+    const struct sockaddr_storage _addr;
+    const socklen_t _addrlen;
+    const string _host;
+    vector<unique_ptr<AsyncClient> > _clients;
+    std::priority_queue<timer, vector<timer>, std::greater<timer> > _timers;
+    int _epfd;
+
+    static constexpr double min_backoff = 0.010;
+    static constexpr double max_backoff = 5.0;
+    static constexpr double config_poll = 0.100;  // how often parked runners and stopping are checked for
+
+    void set_timer(AsyncClient &c, timestamp_t when) {
+        c.wake = std::max<timestamp_t>(when, 1);
+        _timers.push(timer(c.wake, &c));
+    }
+
+    void watch(AsyncClient &c, int op, uint32_t events) {
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = &c;
+        if (epoll_ctl(_epfd, op, c.fd, &ev) != 0) {
+            throw std::runtime_error(string("epoll_ctl: ") + strerror(errno));
+        }
+    }
+
+    void connect(AsyncClient &c) {
+        c.fd = socket(_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c.fd < 0) {
+            cerr << "couldn't make a socket: " << strerror(errno) << endl;
+            broken(c);
+            return;
+        }
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        c.state = AsyncClient::connecting;
+        c.want_write = true;
+        watch(c, EPOLL_CTL_ADD, EPOLLOUT);
+        if (::connect(c.fd, reinterpret_cast<const struct sockaddr *>(&_addr), _addrlen) != 0 && errno != EINPROGRESS) {
+            cerr << "couldn't connect to " << _host << ": " << strerror(errno) << endl;
+            broken(c);
+        }
+        // Either way, epoll tells us when it's done.
+    }
+
+    void connected(AsyncClient &c) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            cerr << "couldn't connect to " << _host << ": " << strerror(err) << endl;
+            broken(c);
+            return;
+        }
+        c.state = AsyncClient::idle;
+        c.want_write = false;
+        watch(c, EPOLL_CTL_MOD, EPOLLIN);
+        schedule(c);
+    }
+
+    /** Drops c's connection, failing any op in flight, and sets a timer to reconnect after a backoff. */
+    void broken(AsyncClient &c) {
+        if (c.state == AsyncClient::busy) {
+            c.runner->fail_op();
+        }
+        if (c.state == AsyncClient::idle || c.state == AsyncClient::busy) {
+            cerr << "lost connection to " << _host << ", reconnecting" << endl;
+        }
+        if (c.fd >= 0) {
+            close(c.fd);
+            c.fd = -1;
+        }
+        c.state = AsyncClient::disconnected;
+        c.want_write = false;
+        c.out.clear();
+        c.out_pos = 0;
+        c.in.clear();
+        c.backend.pending.clear();
+        c.backoff = c.backoff == 0 ? min_backoff : c.backoff * 2;
+        if (c.backoff > max_backoff) {
+            c.backoff = max_backoff;
+        }
+        set_timer(c, now() + secs_to_ts(c.backoff));
+    }
+
+    /** Sets the timer for c's next op, or to check back later if it's parked. */
+    void schedule(AsyncClient &c) {
+        timestamp_t when;
+        if (c.runner->due(when)) {
+            c.intended = when;
+            set_timer(c, when);
+        } else if (c.runner->running()) {
+            set_timer(c, now() + secs_to_ts(config_poll));
+        }
+    }
+
+    void start(AsyncClient &c) {
+        PipelineBackend &b = c.backend;
+        b.out.clear();
+        b.pending.clear();
+        try {
+            c.t0 = c.runner->start_op(b);
+        } catch (std::exception &e) {
+            cerr << "caught exception " << e.what() << endl;
+            c.runner->fail_op();
+            schedule(c);
+            return;
+        }
+        c.state = AsyncClient::busy;
+        c.docs = 0;
+        c.bytes = 0;
+        c.ok = true;
+        c.out += b.out;
+        if (!flush(c)) {
+            return;
+        }
+        if (b.pending.empty()) {
+            finish(c);
+        }
+    }
+
+    void finish(AsyncClient &c) {
+        const timestamp_t t1 = now();
+        if (c.ok) {
+            c.runner->finish_op(c.intended, c.t0, t1, c.docs, c.bytes);
+            c.backoff = 0;
+        } else {
+            c.runner->fail_op();
+        }
+        c.state = AsyncClient::idle;
+        schedule(c);
+    }
+
+    /** Writes as much of c.out as the socket takes.  @return false if the connection broke. */
+    bool flush(AsyncClient &c) {
+        while (c.out_pos < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (!c.want_write) {
+                        c.want_write = true;
+                        watch(c, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+                    }
+                    return true;
+                }
+                broken(c);
+                return false;
+            }
+            c.out_pos += n;
+        }
+        c.out.clear();
+        c.out_pos = 0;
+        if (c.want_write) {
+            c.want_write = false;
+            watch(c, EPOLL_CTL_MOD, EPOLLIN);
+        }
+        return true;
+    }
+
+    /** Reads what's there and handles every whole reply.  @return false if the connection broke. */
+    bool receive(AsyncClient &c) {
+        char buf[64 << 10];
+        while (true) {
+            ssize_t n = recv(c.fd, buf, sizeof buf, 0);
+            if (n > 0) {
+                c.in.append(buf, n);
+                if (static_cast<size_t>(n) < sizeof buf) {
+                    break;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            broken(c);
+            return false;
+        }
+
+        size_t pos = 0;
+        while (c.in.size() - pos >= wire::header_size) {
+            int32_t length;
+            memcpy(&length, c.in.data() + pos, sizeof length);
+            if (length < static_cast<int32_t>(wire::header_size) || length > wire::max_message_size) {
+                cerr << "bad message from " << _host << endl;
+                broken(c);
+                return false;
+            }
+            if (c.in.size() - pos < static_cast<size_t>(length)) {
+                break;
+            }
+            if (!reply(c, c.in.data() + pos, length)) {
+                return false;
+            }
+            pos += length;
+        }
+        c.in.erase(0, pos);
+        return true;
+    }
+
+    /** Handles one reply.  @return false if the connection broke. */
+    bool reply(AsyncClient &c, const char *msg, size_t len) {
+        PipelineBackend &b = c.backend;
+        const wire::Header &h = *reinterpret_cast<const wire::Header *>(msg);
+        // Usually the oldest, but a getMore's reply comes after those of requests already sent behind its query.
+        auto it = std::find_if(b.pending.begin(), b.pending.end(), [&h](const PipelineBackend::Pending &p) { return p.request_id == h.response_to; });
+        if (c.state != AsyncClient::busy || it == b.pending.end() || h.op != wire::op_reply) {
+            cerr << "unexpected reply from " << _host << endl;
+            broken(c);
+            return false;
+        }
+        PipelineBackend::Pending &p = *it;
+        int32_t flags;
+        int64_t cursor;
+        int32_t nreturned;
+        BSONObj res;  // a command's (i.e. getLastError's) reply
+        try {
+            wire::Reader r(msg + wire::header_size, len - wire::header_size);
+            flags = r.int32();
+            cursor = r.int64();
+            r.int32();
+            nreturned = r.int32();
+            if (p.ns.empty() && nreturned > 0) {
+                res = r.doc();
+            }
+        } catch (std::exception &e) {
+            cerr << "bad reply from " << _host << ": " << e.what() << endl;
+            broken(c);
+            return false;
+        }
+        if (flags & (wire::reply_query_failure | wire::reply_cursor_not_found)) {
+            c.ok = false;
+            cursor = 0;
+        } else if (p.ns.empty()) {
+            try {
+                check_getlasterror(res);
+            } catch (std::exception &) {
+                c.ok = false;
+            }
+        } else {
+            static const size_t reply_fields = 20;  // flags, cursor id, starting from, # returned
+            c.docs += nreturned;
+            c.bytes += len - wire::header_size - reply_fields;
+            p.returned += nreturned;
+        }
+
+        if (cursor != 0 && !p.ns.empty()) {
+            if (p.limit == 0 || p.returned < p.limit) {
+                p.request_id = b.next_id();
+                wire::Builder gm(wire::op_get_more, p.request_id, 0);
+                gm.int32(0);
+                gm.cstring(p.ns);
+                gm.int32(p.limit > 0 ? std::min<int64_t>(p.limit - p.returned, p.batch_size > 0 ? p.batch_size : p.limit) : p.batch_size);
+                gm.int64(cursor);
+                c.out += gm.finish();
+                return flush(c);
+            }
+            wire::Builder kc(wire::op_kill_cursors, b.next_id(), 0);
+            kc.int32(0);
+            kc.int32(1);
+            kc.int64(cursor);
+            c.out += kc.finish();
+            if (!flush(c)) {
+                return false;
+            }
+        }
+        b.pending.erase(it);
+        if (b.pending.empty()) {
+            finish(c);
+        }
+        return true;
+    }
+
+    /** Handles c's timer going off. */
+    void wake(AsyncClient &c) {
+        if (!c.runner->running()) {
+            return;
+        }
+        if (c.state == AsyncClient::disconnected) {
+            connect(c);
+        } else if (c.state == AsyncClient::idle) {
+            timestamp_t when;
+            if (!c.runner->due(when)) {
+                schedule(c);
+            } else if (when > now()) {
+                // Rescheduled (e.g. a new phase) since the timer was set.
+                c.intended = when;
+                set_timer(c, when);
+            } else {
+                start(c);
+            }
+        }
+    }
+
+    bool all_stopped() const {
+        return std::none_of(_clients.begin(), _clients.end(), [](const unique_ptr<AsyncClient> &c) { return c->runner->running(); });
+    }
+
+  public:
+    AsyncWorker(const struct sockaddr_storage &addr, socklen_t addrlen, const string &host) : _addr(addr), _addrlen(addrlen), _host(host), _epfd(epoll_create1(EPOLL_CLOEXEC)) {
+        if (_epfd < 0) {
+            throw std::runtime_error(string("epoll_create1: ") + strerror(errno));
+        }
+    }
+    ~AsyncWorker() {
+        for (auto it = _clients.begin(); it != _clients.end(); ++it) {
+            if ((*it)->fd >= 0) {
+                close((*it)->fd);
+            }
+        }
+        close(_epfd);
+    }
+
+    void add(CollectionRunner *runner) {
+        runner->set_pipelined();
+        _clients.push_back(unique_ptr<AsyncClient>(new AsyncClient(runner)));
+    }
+
+    void run() {
+        const timestamp_t t0 = now();
+        for (size_t i = 0; i < _clients.size(); ++i) {
+            // Spread the first connections over a little while, rather than all at once.
+            set_timer(*_clients[i], t0 + secs_to_ts(min_backoff * i / _clients.size()));
+        }
+
+        const int max_events = 256;
+        struct epoll_event events[max_events];
+        timestamp_t next_check = t0;
+        while (true) {
+            timestamp_t t = now();
+            if (t >= next_check) {
+                if (all_stopped()) {
+                    break;
+                }
+                next_check = t + secs_to_ts(config_poll);
+            }
+
+            while (!_timers.empty() && _timers.top().first <= t) {
+                AsyncClient &c = *_timers.top().second;
+                const timestamp_t when = _timers.top().first;
+                _timers.pop();
+                if (c.wake == when) {  // otherwise the timer was replaced
+                    c.wake = 0;
+                    wake(c);
+                }
+            }
+
+            // epoll only has ms resolution: within a ms of the next timer, poll without blocking.
+            timestamp_t until = std::min(next_check, _timers.empty() ? next_check : _timers.top().first);
+            t = now();
+            int timeout = until <= t ? 0 : static_cast<int>(ts_to_nsecs(until - t) / 1000000);
+            int n = epoll_wait(_epfd, events, max_events, timeout);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(string("epoll_wait: ") + strerror(errno));
+            }
+            for (int i = 0; i < n; ++i) {
+                AsyncClient &c = *static_cast<AsyncClient *>(events[i].data.ptr);
+                const uint32_t ev = events[i].events;
+                if (c.state == AsyncClient::connecting) {
+                    if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                        connected(c);
+                    }
+                    continue;
+                }
+                if (c.fd < 0) {
+                    continue;
+                }
+                if ((ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !receive(c)) {
+                    continue;
+                }
+                if ((ev & EPOLLOUT) && c.fd >= 0) {
+                    flush(c);
+                }
+            }
+        }
+    }
+};
+
+AsyncEngine::AsyncEngine(const Options &opts, const vector<CollectionRunner *> &runners) {
+    if (opts.backend != BackendType::mongo) {
+        throw std::runtime_error("--engine=async only works with --backend=mongo");
+    }
+    if (opts.host.find("mongodb://") != string::npos || opts.host.find(',') != string::npos) {
+        throw std::runtime_error("--engine=async needs a single host[:port], not " + opts.host);
+    }
+    string host = opts.host;
+    string port = "27017";
+    const size_t colon = host.rfind(':');
+    if (colon != string::npos && host.find(':') == colon) {
+        port = host.substr(colon + 1);
+        host = host.substr(0, colon);
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res;
+    int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0) {
+        throw std::runtime_error("can't resolve " + opts.host + ": " + gai_strerror(err));
+    }
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof addr);
+    memcpy(&addr, res->ai_addr, res->ai_addrlen);
+    const socklen_t addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    // Every runner needs its own socket.
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max && rl.rlim_cur < runners.size() + 1024) {
+        rl.rlim_cur = std::min<rlim_t>(rl.rlim_max, runners.size() + 1024);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    const size_t nworkers = std::max<size_t>(std::min(workers, runners.size()), 1);
+    for (size_t i = 0; i < nworkers; ++i) {
+        _workers.push_back(unique_ptr<AsyncWorker>(new AsyncWorker(addr, addrlen, opts.host)));
+    }
+    for (size_t i = 0; i < runners.size(); ++i) {
+        _workers[worker_of(i)]->add(runners[i]);
+    }
+    for (size_t i = 0; i < _workers.size(); ++i) {
+        AsyncWorker *w = _workers[i].get();
+        _threads.push_back(std::thread([w, i]() {
+                    Placement::get().enter(i);
+                    try {
+                        w->run();
+                    } catch (std::exception &e) {
+                        cerr << "async worker died: " << e.what() << endl;
+                    }
+                }));
+    }
+}
+
+AsyncEngine::~AsyncEngine() {
+    join();
+}
+
+void AsyncEngine::join() {
+    std::for_each(_threads.begin(), _threads.end(), [](std::thread &t) {
+            if (t.joinable()) {
+                t.join();
+            }
+        });
+}
+
+} // namespace cortisol
@@ -0,0 +1,112 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "mongo/client/dbclient.h"
+
+#include "backend.h"
+#include "collection.h"
+#include "options.h"
+
+namespace cortisol {
+
+namespace po = boost::program_options;
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+/**
+ * A Backend that only writes things down: each call appends a legacy
+ * wire protocol message to out, and the ones that will get a reply are
+ * noted in pending, for an AsyncEngine to send and wait for.  Since calls
+ * return before anything is sent, query() calls f on nothing and returns
+ * 0 (the engine counts results from the replies), and ack() sends a
+ * getLastError (unless the write concern is unacknowledged) and assumes
+ * the write affected one document.
+ */
+class PipelineBackend : public Backend {
+  public:
+    /** A request we expect a reply to. */
+    class Pending {
+      public:
+        int32_t request_id;
+        string ns;           // for queries, for their getMores; empty for commands
+        int32_t batch_size;  // 0 for the server's default
+        int32_t limit;       // 0 for no limit
+        int64_t returned;
+    };
+
+    string out;
+    std::deque<Pending> pending;
+
+  private:
+    int32_t &_next_id;
+    string _last_ns;
+
+  public:
+    /** next_id: where to take request ids from, shared by everything on the same connection. */
+    explicit PipelineBackend(int32_t &next_id) : _next_id(next_id) {}
+
+    int32_t next_id() {
+        return _next_id++;
+    }
+
+    void insert(const string &ns, const vector<mongo::BSONObj> &docs);
+    void update(const string &ns, const mongo::BSONObj &query, const mongo::BSONObj &update);
+    void remove(const string &ns, const mongo::BSONObj &query, bool just_one);
+    using Backend::ack;
+    uint64_t ack(WriteConcern wc);
+    uint64_t query(const string &ns, const mongo::BSONObj &query, const ReadOptions &opts, const std::function<void(const mongo::BSONObj&)> &f);
+};
+
+class AsyncWorker;
+
+/**
+ * Drives runners without a thread each: async.workers threads each own a
+ * share of the runners, give every one its own non-blocking connection
+ * to the server, and multiplex them with epoll.  Each runner is a
+ * virtual client with one op in flight at a time, on its own schedule,
+ * so one load box can hold tens of thousands of connections.
+ *
+ * Runners' steps run on a PipelineBackend: a step's requests all go out
+ * back to back, and the op is done when the last of their replies (and
+ * any getMores) is in.  Only plain host[:port] servers are supported, not
+ * replica sets, and not the mock backend.
+ */
+class AsyncEngine {
+    vector<unique_ptr<AsyncWorker> > _workers;
+    vector<std::thread> _threads;
+
+  public:
+    /** Starts the workers on runners.  @throws std::runtime_error if we can't connect the way opts says. */
+    AsyncEngine(const Options &opts, const vector<CollectionRunner *> &runners);
+    ~AsyncEngine();
+    AsyncEngine(const AsyncEngine&) = delete;
+    AsyncEngine& operator=(const AsyncEngine&) = delete;
+
+    /** Waits for the workers, which finish once all their runners are stopped. */
+    void join();
+
+    /** @return the worker that runner i of them goes to, which is also its Placement slot. */
+    static size_t worker_of(size_t i) {
+        return workers == 0 ? 0 : i % workers;
+    }
+
+    // config
+    static size_t workers;
+    static po::options_description options_description();
+};
+
+} // namespace cortisol
@@ -0,0 +1,159 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "backend.h"
+
+#include <memory>
+#include <stdexcept>
+
+namespace cortisol {
+
+using std::auto_ptr;
+
+using mongo::BSONObj;
+
+std::istream &operator>>(std::istream &is, BackendType &type) {
+    string s;
+    is >> s;
+    if (s == "mongo") {
+        type = BackendType::mongo;
+    } else if (s == "mock") {
+        type = BackendType::mock;
+    } else {
+        is.setstate(std::ios_base::failbit);
+    }
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const BackendType &type) {
+    return os << (type == BackendType::mock ? "mock" : "mongo");
+}
+
+std::istream &operator>>(std::istream &is, WriteConcern &wc) {
+    string s;
+    is >> s;
+    if (s == "unacknowledged") {
+        wc = WriteConcern::unacknowledged;
+    } else if (s == "acknowledged") {
+        wc = WriteConcern::acknowledged;
+    } else if (s == "journaled") {
+        wc = WriteConcern::journaled;
+    } else if (s == "majority") {
+        wc = WriteConcern::majority;
+    } else {
+        is.setstate(std::ios_base::failbit);
+    }
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const WriteConcern &wc) {
+    switch (wc) {
+        case WriteConcern::unacknowledged:
+            return os << "unacknowledged";
+        case WriteConcern::journaled:
+            return os << "journaled";
+        case WriteConcern::majority:
+            return os << "majority";
+        case WriteConcern::acknowledged:
+        default:
+            return os << "acknowledged";
+    }
+}
+
+BSONObj getlasterror_command(WriteConcern wc) {
+    switch (wc) {
+        case WriteConcern::journaled:
+            return BSON("getlasterror" << 1 << "j" << true);
+        case WriteConcern::majority:
+            return BSON("getlasterror" << 1 << "w" << "majority");
+        case WriteConcern::acknowledged:
+        default:
+            return BSON("getlasterror" << 1);
+    }
+}
+
+void check_getlasterror(const BSONObj &res) {
+    if (!res["ok"].trueValue()) {
+        throw std::runtime_error("getLastError failed: " + res.toString());
+    }
+    if (res["err"].type() == mongo::String) {
+        throw std::runtime_error("write failed: " + res["err"].str());
+    }
+    if (res["wtimeout"].trueValue() || res["jnote"].ok() || res["wnote"].ok()) {
+        throw std::runtime_error("write concern not satisfied: " + res.toString());
+    }
+}
+
+void MongoBackend::insert(const string &ns, const vector<BSONObj> &docs) {
+    _conn->insert(ns, docs);
+}
+
+void MongoBackend::update(const string &ns, const BSONObj &query, const BSONObj &update) {
+    _conn->update(ns, query, update);
+}
+
+void MongoBackend::remove(const string &ns, const BSONObj &query, bool just_one) {
+    _conn->remove(ns, query, just_one);
+}
+
+uint64_t MongoBackend::ack(WriteConcern wc) {
+    if (wc == WriteConcern::unacknowledged) {
+        return 0;
+    }
+    BSONObj res;
+    if (wc == WriteConcern::acknowledged) {
+        res = _conn->getLastErrorDetailed();
+    } else {
+        _conn->runCommand("admin", getlasterror_command(wc), res);
+    }
+    check_getlasterror(res);
+    return res["n"].numberLong();
+}
+
+uint64_t MongoBackend::query(const string &ns, const BSONObj &query, const ReadOptions &opts, const std::function<void(const BSONObj&)> &f) {
+    if (opts.exhaust) {
+        return _conn->query(f, ns, query, opts.fields, mongo::QueryOption_Exhaust);
+    }
+    uint64_t n = 0;
+    auto_ptr<mongo::DBClientCursor> c = _conn->query(ns, query, opts.limit, 0, opts.fields, 0, opts.batch_size);
+    while (c->more()) {
+        f(c->next());
+        ++n;
+    }
+    return n;
+}
+
+MockStore &MockBackend::store(const string &ns) {
+    // Runners stick to one collection, so this almost never takes MockStore::get()'s lock.
+    if (_store == NULL || ns != _ns) {
+        _store = &MockStore::get(ns, _keyspace);
+        _ns = ns;
+    }
+    return *_store;
+}
+
+void MockBackend::insert(const string &ns, const vector<BSONObj> &docs) {
+    MockStore::delay();
+    store(ns).insert(docs);
+    _last_n = docs.size();
+}
+
+void MockBackend::update(const string &ns, const BSONObj &query, const BSONObj &update) {
+    MockStore::delay();
+    _last_n = store(ns).update(query, update);
+}
+
+void MockBackend::remove(const string &ns, const BSONObj &query, bool just_one) {
+    MockStore::delay();
+    _last_n = store(ns).remove(query, just_one);
+}
+
+uint64_t MockBackend::ack(WriteConcern wc) {
+    return wc == WriteConcern::unacknowledged ? 0 : _last_n;
+}
+
+uint64_t MockBackend::query(const string &ns, const BSONObj &query, const ReadOptions &opts, const std::function<void(const BSONObj&)> &f) {
+    MockStore::delay();
+    return store(ns).query(query, opts.fields, opts.exhaust ? 0 : opts.limit, f);
+}
+
+} // namespace cortisol
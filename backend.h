@@ -0,0 +1,136 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "mongo/client/dbclient.h"
+
+#include "mock_store.h"
+
+namespace cortisol {
+
+using std::string;
+using std::vector;
+
+/** What the stressors talk to. */
+enum class BackendType {
+    mongo,  // a real server, through the driver
+    mock    // an in-process MockStore, to measure cortisol itself
+};
+
+std::istream &operator>>(std::istream &is, BackendType &type);
+std::ostream &operator<<(std::ostream &os, const BackendType &type);
+
+/** How long a write waits before it counts as done, i.e. what getLastError is asked for. */
+enum class WriteConcern {
+    unacknowledged,  // don't ask
+    acknowledged,    // applied in memory
+    journaled,       // j: true
+    majority         // w: "majority"
+};
+
+std::istream &operator>>(std::istream &is, WriteConcern &wc);
+std::ostream &operator<<(std::ostream &os, const WriteConcern &wc);
+
+/** @return the getLastError command that waits for wc (which mustn't be unacknowledged). */
+mongo::BSONObj getlasterror_command(WriteConcern wc);
+
+/**
+ * Throws if res, a getLastError reply, says the command or the write
+ * failed, or that the server couldn't wait as asked (no journal, no
+ * replica set, a wtimeout), so a write isn't counted as durable when it
+ * isn't.
+ */
+void check_getlasterror(const mongo::BSONObj &res);
+
+/** How a query's results should be fetched.  Backends that don't have cursors ignore all but fields and limit. */
+class ReadOptions {
+  public:
+    const mongo::BSONObj *fields;  // projection, or NULL for whole documents
+    int limit;                     // 0 for no limit
+    int batch_size;                // 0 for the server's default
+    bool exhaust;                  // stream with an exhaust cursor (ignores limit)
+
+    ReadOptions() : fields(NULL), limit(0), batch_size(0), exhaust(false) {}
+};
+
+/**
+ * The operations stressors do, on one thread's connection.  Queries may
+ * be wrapped ({$query: ..., $hint: ..., $orderby: ...}), but update and
+ * remove selectors are taken literally, as the server does, so a write
+ * can't be sorted.  Writes are unacknowledged until ack() is called.
+ */
+class Backend {
+  public:
+    virtual ~Backend() {}
+
+    virtual void insert(const string &ns, const vector<mongo::BSONObj> &docs) = 0;
+    /** Updates the first document matching query. */
+    virtual void update(const string &ns, const mongo::BSONObj &query, const mongo::BSONObj &update) = 0;
+    /** Removes the documents matching query, or just the first. */
+    virtual void remove(const string &ns, const mongo::BSONObj &query, bool just_one) = 0;
+    /**
+     * Waits for the writes so far to be done, by wc's standard.  @return
+     * the # of documents the last one affected, or 0 for unacknowledged,
+     * which doesn't wait.
+     */
+    virtual uint64_t ack(WriteConcern wc) = 0;
+    uint64_t ack() {
+        return ack(WriteConcern::acknowledged);
+    }
+
+    /** Calls f on each result of query.  @return the # of results. */
+    virtual uint64_t query(const string &ns, const mongo::BSONObj &query, const ReadOptions &opts, const std::function<void(const mongo::BSONObj&)> &f) = 0;
+};
+
+/** A Backend on a driver connection, which the owner can swap out between steps. */
+class MongoBackend : public Backend {
+    mongo::DBClientBase *_conn;
+
+  public:
+    MongoBackend() : _conn(NULL) {}
+
+    void reset(mongo::DBClientBase *conn) {
+        _conn = conn;
+    }
+
+    void insert(const string &ns, const vector<mongo::BSONObj> &docs);
+    void update(const string &ns, const mongo::BSONObj &query, const mongo::BSONObj &update);
+    void remove(const string &ns, const mongo::BSONObj &query, bool just_one);
+    using Backend::ack;
+    uint64_t ack(WriteConcern wc);
+    uint64_t query(const string &ns, const mongo::BSONObj &query, const ReadOptions &opts, const std::function<void(const mongo::BSONObj&)> &f);
+};
+
+/**
+ * A Backend on the process's MockStores, adding MockStore::latency to
+ * every request.  Writes are applied right away, and durable as soon as
+ * they are, so ack() just reports them whatever the write concern.
+ */
+class MockBackend : public Backend {
+    const uint64_t _keyspace;
+    string _ns;
+    MockStore *_store;
+    uint64_t _last_n;
+
+    MockStore &store(const string &ns);
+
+  public:
+    /** keyspace: see MockStore::get(). */
+    explicit MockBackend(uint64_t keyspace) : _keyspace(keyspace), _store(NULL), _last_n(0) {}
+
+    void insert(const string &ns, const vector<mongo::BSONObj> &docs);
+    void update(const string &ns, const mongo::BSONObj &query, const mongo::BSONObj &update);
+    void remove(const string &ns, const mongo::BSONObj &query, bool just_one);
+    using Backend::ack;
+    uint64_t ack(WriteConcern wc);
+    uint64_t query(const string &ns, const mongo::BSONObj &query, const ReadOptions &opts, const std::function<void(const mongo::BSONObj&)> &f);
+};
+
+} // namespace cortisol
@@ -0,0 +1,113 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include "mongo/client/dbclient.h"
+
+namespace cortisol {
+
+using std::unique_ptr;
+using std::vector;
+
+/**
+ * A BSON object encoded once, whose NumberLong values can be overwritten
+ * in place before each use.
+ *
+ * Build the shape with BSONObjBuilder, using a long long for every value
+ * you want to change later; those become the slots, numbered in the order
+ * they appear (depth first).  Slots are fixed width, so patching one
+ * never moves anything else, and obj() is just a view of our buffer: a
+ * step costs a few memcpys instead of a builder and a heap allocation.
+ *
+ * With int32 slots, every slot is encoded as a NumberInt instead, for
+ * values that must keep the type fill gave them.
+ *
+ * Not thread safe: give each runner its own.
+ */
+class bson_template {
+  public:
+    /** How slots are encoded. */
+    enum slot_width {
+        int64,  // NumberLong
+        int32   // NumberInt, set() truncates
+    };
+
+  private:
+    const slot_width _width;
+    unique_ptr<char[]> _buf;
+    vector<size_t> _slots;
+
+    /** Copies o into b, with every NumberLong narrowed to a NumberInt. */
+    static void narrow(mongo::BSONObjBuilder &b, const mongo::BSONObj &o) {
+        mongo::BSONObjIterator it(o);
+        while (it.more()) {
+            mongo::BSONElement e = it.next();
+            if (e.type() == mongo::NumberLong) {
+                b.append(e.fieldName(), (int) e.numberLong());
+            } else if (e.type() == mongo::Object || e.type() == mongo::Array) {
+                mongo::BSONObjBuilder sub(e.type() == mongo::Object ? b.subobjStart(e.fieldName()) : b.subarrayStart(e.fieldName()));
+                narrow(sub, e.embeddedObject());
+                sub.doneFast();
+            } else {
+                b.append(e);
+            }
+        }
+    }
+
+    /** Records where in o, our encoding of shape, each of shape's NumberLongs ended up. */
+    void find_slots(const mongo::BSONObj &shape, const mongo::BSONObj &o) {
+        mongo::BSONObjIterator s(shape);
+        mongo::BSONObjIterator it(o);
+        while (s.more()) {
+            mongo::BSONElement se = s.next();
+            mongo::BSONElement e = it.next();
+            if (se.type() == mongo::NumberLong) {
+                _slots.push_back(e.value() - _buf.get());
+            } else if (se.isABSONObj()) {
+                find_slots(se.embeddedObject(), e.embeddedObject());
+            }
+        }
+    }
+
+  public:
+    explicit bson_template(const mongo::BSONObj &shape, slot_width width = int64) : _width(width) {
+        mongo::BSONObj encoded = shape;
+        if (width == int32) {
+            mongo::BSONObjBuilder b;
+            narrow(b, shape);
+            encoded = b.obj();
+        }
+        _buf.reset(new char[encoded.objsize()]);
+        memcpy(_buf.get(), encoded.objdata(), encoded.objsize());
+        find_slots(shape, obj());
+    }
+    bson_template(const bson_template&) = delete;
+    bson_template& operator=(const bson_template&) = delete;
+
+    size_t slots() const {
+        return _slots.size();
+    }
+
+    /** Sets the value of the slot'th slot.  BSON is little endian, like every host we run on. */
+    void set(size_t slot, long long x) {
+        if (_width == int32) {
+            const int32_t y = x;
+            memcpy(&_buf[_slots[slot]], &y, sizeof y);
+        } else {
+            memcpy(&_buf[_slots[slot]], &x, sizeof x);
+        }
+    }
+
+    /** @return a view of the current contents, valid until we're destroyed. */
+    mongo::BSONObj obj() const {
+        return mongo::BSONObj(_buf.get());
+    }
+};
+
+} // namespace cortisol
@@ -2,6 +2,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
@@ -14,9 +16,17 @@
 
 #include "mongo/client/dbclient.h"
 
+#include "aligned.h"
+#include "backend.h"
+#include "connection.h"
 #include "counter.h"
+#include "histogram.h"
 #include "options.h"
 #include "output.h"
+#include "report.h"
+#include "rng.h"
+#include "schedule.h"
+#include "slow_ops.h"
 #include "thread.h"
 
 namespace cortisol {
@@ -79,7 +89,11 @@ class Collection : public ConnectionInfo {
         return _is_tokumx;
     }
   public:
-    Collection(const Options &opts, const string &ns) : ConnectionInfo(opts, ns), _c(mongo::ScopedDbConnection::getScopedDbConnection(opts.host)) {
+    Collection(const Options &opts, const string &ns) : ConnectionInfo(opts, ns), _is_tokumx(false) {
+        if (opts.backend == BackendType::mock) {
+            return;
+        }
+        _c.reset(mongo::ScopedDbConnection::getScopedDbConnection(opts.host));
         BSONObj res;
         bool ok = conn().simpleCommand("admin", &res, "buildInfo");
         assert(ok);
@@ -102,21 +116,228 @@ class Collection : public ConnectionInfo {
     static size_t padding;
     static double compressibility;
     static po::options_description options_description();
+    static size_t generator_threads;
+    static bool ordered_fill;
+    static size_t writers;
+    static po::options_description fill_options_description();
 
     Collection(Collection &&o) = default;
     Collection &operator=(Collection &&o) = default;
 };
 
-class CollectionRunner : public ConnectionInfo {
+/**
+ * Throughput and latency of one kind of operation a runner does.
+ *
+ * The runner thread is the only writer, and the reporter only reads
+ * snapshots, so everything is updated with relaxed stores.  The runner's
+ * part and the reporter's bookkeeping each start on their own cache line,
+ * so neither thread's writes bounce the other's lines, and neither do
+ * other runners' stats allocated next to this one.
+ */
+class op_stats : public cache_aligned {
+    alignas(cache_line_size) std::atomic<uint64_t> _steps;
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _docs;
+    std::atomic<uint64_t> _errors;
+
+  public:
+    histogram latency;
+    histogram late;  // how far behind schedule late ops started
+
+  private:
+    alignas(cache_line_size) const timestamp_t _t0;
+    timestamp_t _last_t;
+    uint64_t _last_steps;
+    uint64_t _last_bytes;
+    uint64_t _last_docs;
+    uint64_t _last_errors;
+    histogram::snapshot _last_latency;
+    histogram::snapshot _last_late;
+
+  public:
+    op_stats(timestamp_t t0) : _steps(0), _bytes(0), _docs(0), _errors(0), _t0(t0), _last_t(t0), _last_steps(0), _last_bytes(0), _last_docs(0), _last_errors(0) {}
+
+    // Runner thread only.
+    void step(uint64_t n = 1) {
+        bump<uint64_t>(_steps, n);
+    }
+    void add_bytes(uint64_t n) {
+        bump<uint64_t>(_bytes, n);
+    }
+    void add_docs(uint64_t n) {
+        bump<uint64_t>(_docs, n);
+    }
+    void error() {
+        bump<uint64_t>(_errors);
+    }
+
+    /** Fills in r with the interval since the last report(). */
+    void report(Record &r, timestamp_t ti) {
+        r.period = ts_to_secs(ti - _last_t);
+        r.elapsed = ts_to_secs(ti - _t0);
+        _last_t = ti;
+
+        r.c_ops = _steps.load(std::memory_order_relaxed);
+        r.ops = r.c_ops - _last_steps;
+        _last_steps = r.c_ops;
+        r.c_bytes = _bytes.load(std::memory_order_relaxed);
+        r.bytes = r.c_bytes - _last_bytes;
+        _last_bytes = r.c_bytes;
+        r.c_docs = _docs.load(std::memory_order_relaxed);
+        r.docs = r.c_docs - _last_docs;
+        _last_docs = r.c_docs;
+        r.c_errors = _errors.load(std::memory_order_relaxed);
+        r.errors = r.c_errors - _last_errors;
+        _last_errors = r.c_errors;
+
+        r.c_latency = latency.snap();
+        r.latency = r.c_latency;
+        r.latency -= _last_latency;
+        _last_latency = r.c_latency;
+        r.c_late = late.snap();
+        r.late = r.c_late;
+        r.late -= _last_late;
+        _last_late = r.c_late;
+    }
+
+    /** Fills in r with the totals for the whole run. */
+    void total(Record &r, timestamp_t ti) const {
+        r.total = true;
+        r.elapsed = ts_to_secs(ti - _t0);
+        r.c_ops = _steps.load(std::memory_order_relaxed);
+        r.c_bytes = _bytes.load(std::memory_order_relaxed);
+        r.c_docs = _docs.load(std::memory_order_relaxed);
+        r.c_errors = _errors.load(std::memory_order_relaxed);
+        r.c_latency = latency.snap();
+        r.c_late = late.snap();
+    }
+};
+
+class alignas(cache_line_size) CollectionRunner : public ConnectionInfo, public cache_aligned {
     bool _running;
     size_t _id;
-    counter<size_t> _steps;
+
+    // Phase configuration, set by configure() and picked up by the runner
+    // thread between steps.
+    std::mutex _config_mutex;
+    std::condition_variable _config_cond;
+    bool _active;
+    double _rate;
+    size_t _nthreads;
+    std::atomic<unsigned> _config_gen;
+    unsigned _applied_gen;
+
+    timestamp_t _t0;
+    vector<unique_ptr<op_stats> > _stats;
+    size_t _op;
+    schedule _schedule;
+    RunnerConnection _conn;
+    op_watch _watch;
+    const timestamp_t _slow;      // SlowOps::threshold()
+    const bool _sampling;         // whether to keep _request for SlowOps::sample()
+    mongo::BSONObj _request;
+    bool _pipelined;              // step() only queues requests, see set_pipelined()
+    bool _applied_active;         // _active as of _applied_gen, for due()
+
+    /** Called by the runner thread when configure() was called: applies the new rate, and parks here while inactive. */
+    void reconfigure() {
+        std::unique_lock<std::mutex> lk(_config_mutex);
+        while (!_active && _running) {
+            _config_cond.wait(lk);
+        }
+        _schedule.reset(_rate, _nthreads, _id);
+        _applied_gen = _config_gen;
+    }
+
+    /** Starts timing an op and runs its step() on b.  @return its start time. */
+    timestamp_t begin_op(Backend &b) {
+        if (_sampling) {
+            _request = BSONObj();
+        }
+        timestamp_t t0 = now();
+        _watch.begin(t0, &op_name(_op));
+        step(b);
+        return t0;
+    }
+
+    /** Charges an op that was due at intended, started at t0 and finished at t1 to the current op type. */
+    void end_op(timestamp_t intended, timestamp_t t0, timestamp_t t1) {
+        if (_slow != 0 && t1 - t0 >= _slow) {
+            SlowOps::sample(ns(), op_name(_op), _watch.key.load(std::memory_order_relaxed), t1 - t0, _request);
+        }
+        op_stats &stats = *_stats[_op];
+        if (_schedule.open()) {
+            // Measure from when the op should have been sent, so a stall
+            // is charged to every op queued behind it.
+            if (t0 > intended) {
+                stats.late.record(t0 - intended);
+            }
+            t0 = intended;
+        }
+        stats.latency.record(t1 - t0);
+        stats.step();
+    }
+
+    friend class Step;
+
+  protected:
+    rng _rng;
+
+    /** For runners that do several kinds of operation: keep separate stats for n of them. */
+    void set_op_types(size_t n) {
+        while (_stats.size() < n) {
+            _stats.push_back(unique_ptr<op_stats>(new op_stats(_t0)));
+        }
+    }
+    /** Charge the current step to operation type op (see op_name()). */
+    void set_op(size_t op) {
+        _op = op;
+        _watch.op.store(&op_name(op), std::memory_order_relaxed);
+    }
+
+    /**
+     * Tells the slow op reporting which key the current step is working
+     * on, and what it sent, if there's one request worth showing.
+     * request must stay valid until the step returns.
+     */
+    void set_request(long long key, const BSONObj &request = BSONObj()) {
+        _watch.key.store(key, std::memory_order_relaxed);
+        if (_sampling) {
+            _request = request;
+        }
+    }
+
+    /** Count n bytes read or written by the current step. */
+    void add_bytes(uint64_t n) {
+        _stats[_op]->add_bytes(n);
+    }
+
+    /** Count n documents returned by the current step. */
+    void add_docs(uint64_t n) {
+        _stats[_op]->add_docs(n);
+    }
+
+    /**
+     * Counts n ops of type op that took latency each, separately from the
+     * step as a whole (e.g. the keys in a batched step).  Dropped when
+     * pipelined, when the step doesn't see its requests' latency.
+     */
+    void record(size_t op, timestamp_t latency, uint64_t n = 1) {
+        if (!_pipelined) {
+            op_stats &stats = *_stats[op];
+            stats.latency.record(latency, n);
+            stats.step(n);
+        }
+    }
 
   public:
-    CollectionRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : ConnectionInfo(opts, ns), _running(true), _id(id), _steps(t0) {}
+    CollectionRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : ConnectionInfo(opts, ns), _running(true), _id(id), _active(true), _rate(0), _nthreads(1), _config_gen(0), _applied_gen(0), _t0(t0), _op(0), _conn(_opts, Collection::documents), _slow(SlowOps::threshold()), _sampling(_slow != 0 && !SlowOps::sample_file.empty()), _pipelined(false), _applied_active(true), _rng(rng::fresh_seed()) {
+        _watch.ns = &ConnectionInfo::ns();
+        set_op_types(1);
+    }
 
     class UnimplementedException : public std::exception {};
-    virtual void step(mongo::DBClientBase &) {
+    virtual void step(Backend &) {
         throw UnimplementedException();
     }
 
@@ -125,13 +346,64 @@ class CollectionRunner : public ConnectionInfo {
         return n;
     }
 
+    /** @return the name to report operation type op under. */
+    virtual const string &op_name(size_t op) const {
+        return name();
+    }
+
+    size_t id() const {
+        return _id;
+    }
+
+    /** What this runner is doing right now, for a SlowOpWatchdog. */
+    const op_watch &watch() const {
+        return _watch;
+    }
+
+    /**
+     * Sets whether this runner should be working, and if so, at what rate
+     * (see set_rate()).  An inactive runner parks between steps, keeping
+     * its connection, until it's made active again or stopped.
+     */
+    void configure(bool active, double rate, size_t nthreads) {
+        std::lock_guard<std::mutex> lk(_config_mutex);
+        _active = active;
+        _rate = rate;
+        _nthreads = nthreads;
+        ++_config_gen;
+        _config_cond.notify_all();
+    }
+
+    bool active() {
+        std::lock_guard<std::mutex> lk(_config_mutex);
+        return _active;
+    }
+
+    /** Run open-loop at rate ops/sec, shared by nthreads runners of this type.  0 means closed loop. */
+    void set_rate(double rate, size_t nthreads) {
+        configure(true, rate, nthreads);
+    }
+
     void operator()() {
         while (_running) {
-            unique_ptr<mongo::ScopedDbConnection> c(mongo::ScopedDbConnection::getScopedDbConnection(_opts.host));
+            if (_config_gen != _applied_gen) {
+                reconfigure();
+                continue;
+            }
+            timestamp_t intended = _schedule.wait(_running);
+            if (!_running) {
+                break;
+            }
+            bool ok = false;
             try {
                 interrupter.check_for_interrupt();
-                step(c->conn());
-                _steps++;
+                Backend *c = _conn.get(_running);
+                if (c == NULL) {
+                    break;
+                }
+                timestamp_t t0 = begin_op(*c);
+                end_op(intended, t0, now());
+                ok = true;
             } catch (interrupt_exception &e) {
                 stop();
             } catch (UnimplementedException) {
@@ -139,39 +411,103 @@ class CollectionRunner : public ConnectionInfo {
                 stop();
             } catch (std::exception &e) {
                 cerr << "caught exception " << e.what() << endl;
+                _stats[_op]->error();
             }
-            c->done();
+            _watch.end();
+            _conn.done(ok);
+        }
+    }
+
+    // For engines that drive many runners from one thread instead of
+    // running each one's operator() on its own (see async.h).  Only that
+    // thread may call these.
+
+    /** Says step() will only queue requests on its Backend, for the engine to send and wait for. */
+    void set_pipelined() {
+        _pipelined = true;
+    }
+
+    bool running() const {
+        return _running;
+    }
+
+    /**
+     * Applies any new configuration without blocking.  @return whether
+     * the runner should be working now, and if so, sets when to the time
+     * its next op is due.
+     */
+    bool due(timestamp_t &when) {
+        if (_config_gen != _applied_gen) {
+            std::lock_guard<std::mutex> lk(_config_mutex);
+            _schedule.reset(_rate, _nthreads, _id);
+            _applied_gen = _config_gen;
+            _applied_active = _active;
         }
+        if (!_applied_active || !_running) {
+            return false;
+        }
+        when = _schedule.due();
+        return true;
+    }
+
+    /** Runs step() on b to queue the requests for the op that due() said was next.  @return its start time. */
+    timestamp_t start_op(Backend &b) {
+        _schedule.advance();
+        return begin_op(b);
+    }
+
+    /** The op due at intended and started at t0 got all its replies at t1, with docs documents totalling bytes. */
+    void finish_op(timestamp_t intended, timestamp_t t0, timestamp_t t1, uint64_t docs, uint64_t bytes) {
+        _watch.end();
+        _stats[_op]->add_docs(docs);
+        _stats[_op]->add_bytes(bytes);
+        end_op(intended, t0, t1);
     }
 
-    template<class ostream_type>
-    static void header(ostream_type &os) {
-        os << "# " << out::pad(16) << "ns" << ofs
-           << out::pad(10) << "type" << ofs
-           << out::pad(4) << "id" << ofs
-           << counter<size_t>::header() << ors;
+    /** The op started last failed, or its connection broke. */
+    void fail_op() {
+        _watch.end();
+        _stats[_op]->error();
     }
 
-    template<class ostream_type>
-    void report(ostream_type &os, timestamp_t ti) {
-        static std::mutex _m;
-        std::lock_guard<std::mutex> lk(_m);
-        os << out::pad(18) << ns() << ofs
-           << out::pad(10) << name() << ofs
-           << out::pad(4) << _id << ofs
-           << _steps.report(ti) << ors;
+    /** Appends a record for each kind of operation, for the interval since the last report(). */
+    void report(const string &phase, timestamp_t ti, vector<Record> &records) {
+        for (size_t i = 0; i < _stats.size(); ++i) {
+            records.push_back(Record());
+            Record &r = records.back();
+            r.phase = phase;
+            r.ns = ns();
+            r.type = op_name(i);
+            r.id = _id;
+            _stats[i]->report(r, ti);
+        }
     }
 
-    template<class ostream_type>
-    void total(ostream_type &os, timestamp_t ti) {
-        os << out::pad(18) << ns() << ofs
-           << out::pad(10) << name() << ofs
-           << out::pad(4) << _id << ofs
-           << _steps.total(ti) << ors;
+    /** Starts a new reporting interval without reporting anything, e.g. when a runner is unparked. */
+    void mark(timestamp_t ti) {
+        Record r;
+        for (size_t i = 0; i < _stats.size(); ++i) {
+            _stats[i]->report(r, ti);
+        }
+    }
+
+    /** Appends a record for each kind of operation, with totals for the whole run. */
+    void total(timestamp_t ti, vector<Record> &records) {
+        for (size_t i = 0; i < _stats.size(); ++i) {
+            records.push_back(Record());
+            Record &r = records.back();
+            r.phase = "total";
+            r.ns = ns();
+            r.type = op_name(i);
+            r.id = _id;
+            _stats[i]->total(r, ti);
+        }
     }
 
     void stop() {
+        std::lock_guard<std::mutex> lk(_config_mutex);
         _running = false;
+        _config_cond.notify_all();
     }
 };
 
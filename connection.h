@@ -0,0 +1,134 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "mongo/client/dbclient.h"
+
+#include "backend.h"
+#include "options.h"
+#include "thread.h"
+
+namespace cortisol {
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::unique_ptr;
+
+extern thread_interrupter interrupter;
+
+/**
+ * A stressor thread's connection to the server, or to the mock backend.
+ *
+ * In pooled mode this checks a connection out of the global pool for every
+ * step and returns it afterwards, like cortisol always used to.  In
+ * dedicated mode the runner connects once and keeps the connection, and
+ * only reconnects (backing off exponentially) after it breaks.
+ */
+class RunnerConnection {
+    const Options &_opts;
+    unique_ptr<mongo::ScopedDbConnection> _scoped;
+    unique_ptr<mongo::DBClientBase> _conn;
+    MongoBackend _mongo;
+    unique_ptr<MockBackend> _mock;
+    double _backoff;
+
+    static constexpr double min_backoff = 0.010;
+    static constexpr double max_backoff = 5.0;
+
+    void backoff() {
+        _backoff = _backoff == 0 ? min_backoff : _backoff * 2;
+        if (_backoff > max_backoff) {
+            _backoff = max_backoff;
+        }
+    }
+
+    /** Sleeps for the current backoff.  @return false if running went false meanwhile. */
+    bool sleep(const bool &running) const {
+        for (double left = _backoff; running && left > 0; left -= 0.1) {
+            interrupter.check_for_interrupt();
+            usleep(std::min(left, 0.1) * 1000000);
+        }
+        return running;
+    }
+
+    bool connect(const bool &running) {
+        while (running) {
+            interrupter.check_for_interrupt();
+            string errmsg;
+            try {
+                mongo::ConnectionString cs = mongo::ConnectionString::parse(_opts.host, errmsg);
+                if (cs.isValid()) {
+                    _conn.reset(cs.connect(errmsg));
+                }
+            } catch (mongo::DBException &e) {
+                errmsg = e.what();
+            }
+            if (_conn) {
+                return true;
+            }
+            cerr << "couldn't connect to " << _opts.host << ": " << errmsg << endl;
+            backoff();
+            if (!sleep(running)) {
+                break;
+            }
+        }
+        return false;
+    }
+
+  public:
+    /** keyspace: for the mock backend, see MockStore::get(). */
+    RunnerConnection(const Options &opts, uint64_t keyspace) : _opts(opts), _backoff(0) {
+        if (_opts.backend == BackendType::mock) {
+            _mock.reset(new MockBackend(keyspace));
+        }
+    }
+    RunnerConnection(const RunnerConnection&) = delete;
+    RunnerConnection& operator=(const RunnerConnection&) = delete;
+
+    /** @return a backend to run the next step on, or NULL if running went false before we got one. */
+    Backend *get(const bool &running) {
+        if (_mock) {
+            return _mock.get();
+        }
+        if (_opts.connection_mode == ConnectionMode::pooled) {
+            _scoped.reset(mongo::ScopedDbConnection::getScopedDbConnection(_opts.host));
+            _mongo.reset(&_scoped->conn());
+            return &_mongo;
+        }
+        if (!_conn) {
+            if (_backoff > 0 && !sleep(running)) {
+                return NULL;
+            }
+            if (!connect(running)) {
+                return NULL;
+            }
+        }
+        _mongo.reset(_conn.get());
+        return &_mongo;
+    }
+
+    /** Call after each step, whether or not it succeeded. */
+    void done(bool ok) {
+        if (_scoped) {
+            _scoped->done();
+            _scoped.reset();
+        }
+        if (ok) {
+            _backoff = 0;
+        } else if (_conn && _conn->isFailed()) {
+            cerr << "lost connection to " << _opts.host << ", reconnecting" << endl;
+            _conn.reset();
+            backoff();
+        }
+    }
+};
+
+} // namespace cortisol
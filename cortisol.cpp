@@ -3,9 +3,16 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -15,17 +22,20 @@
 #include "mongo/client/dbclient.h"
 #include "mongo/client/remote_loader.h"
 
-#include "alarm.h"
 #include "collection.h"
 #include "cortisol.h"
 #include "counter.h"
 #include "timing.h"
 #include "queue.h"
+#include "placement.h"
+#include "rng.h"
+#include "schema.h"
 #include "words.h"
 
 namespace cortisol {
 
 using std::auto_ptr;
+using std::cerr;
 using std::cout;
 using std::endl;
 using std::shared_ptr;
@@ -42,79 +52,92 @@ string server = "localhost";
 
 Wordlist wl("/usr/share/dict/cracklib-small");
 
-static void gen_field(size_t i, stringstream &ss) {
-    if (i < 26) {
-        ss << (char) ('a' + i);
-    } else {
-        gen_field(i / 26, ss);
-        gen_field(i % 26, ss);
+/**
+ * Appends random field values to b, and an _id if with_id.  If padbuf is
+ * non-NULL, it is used for the padding field: its first (compressible)
+ * part must already be zeroed, and the rest is overwritten with random
+ * bytes here, so callers can reuse one buffer for every document.
+ */
+static void _random_obj(BSONObjBuilder &b, rng &r, bool with_id, char *padbuf) {
+    if (with_id) {
+        b << mongo::GENOID;
+    }
+    const Schema &schema = Schema::get();
+    for (size_t i = 0; i < Collection::fields; ++i) {
+        b.appendIntOrLL(schema.field(i), r.uniform(Collection::documents));
+    }
+    if (padbuf != NULL) {
+        const size_t zero_bytes = Collection::padding * Collection::compressibility;
+        for (size_t j = zero_bytes; j < Collection::padding; j += sizeof(uint64_t)) {
+            const uint64_t x = r();
+            memcpy(&padbuf[j], &x, std::min(sizeof x, Collection::padding - j));
+        }
+        b.appendBinData("padding", Collection::padding, mongo::BinDataGeneral, padbuf);
     }
 }
 
-static string field(size_t i) {
-    static vector<string> fields;
-    while (fields.size() <= i) {
-        stringstream ss;
-        gen_field(fields.size(), ss);
-        fields.push_back(ss.str());
-    }
-    return fields[i];
+DocGenerator::DocGenerator() : _rng(rng::fresh_seed()), _padding(new char[Collection::padding]) {
+    const size_t zero_bytes = Collection::padding * Collection::compressibility;
+    std::fill(&_padding[0], &_padding[zero_bytes], 0);
 }
 
-/** @return the spec for the nth index, defined by interpreting the bits in n. */
-static BSONObj index_spec(size_t n) {
+BSONObj DocGenerator::operator()() {
     BSONObjBuilder b;
-    // Always need at least one field, so keep this out of the loop.
-    b.append("a", (n&1) ? -1 : 1);
-    n >>= 1;
-    for (size_t idx = 1; n > 0; ++idx, n >>= 1) {
-        b.append(field(idx), (n&1) ? -1 : 1);
-    }
+    _random_obj(b, _rng, true, _padding.get());
     return b.obj();
 }
 
-static string index_name(size_t n) {
-    stringstream ss;
-    // Always need at least one field, so keep this out of the loop.
-    ss << "a_" << ((n&1) ? -1 : 1);
-    n >>= 1;
-    for (size_t idx = 1; n > 0; ++idx, n >>= 1) {
-        ss << "_" << field(idx) << "_" << ((n&1) ? -1 : 1);
-    }
-    return ss.str();
+static BSONObj a_cmp_spec(const char *op, long long a) {
+    BSONObjBuilder b;
+    BSONObjBuilder cmpb(b.subobjStart("a"));
+    cmpb.append(op, a);
+    cmpb.doneFast();
+    return b.obj();
 }
 
-/** @return a random document */
-static void _random_obj(BSONObjBuilder &b, bool with_id, bool with_padding) {
-    if (with_id) {
-        b << mongo::GENOID;
-    }
-    for (size_t i = 0; i < Collection::fields; ++i) {
-        b.appendIntOrLL(field(i), random() % Collection::documents);
-    }
-    if (with_padding) {
-        const size_t zero_bytes = Collection::padding * Collection::compressibility;
-        const size_t rand_bytes = Collection::padding - zero_bytes;
-        unique_ptr<char[]> buf(new char[Collection::padding]);
-        std::fill(&buf[0], &buf[zero_bytes], 0);
-        std::generate(&buf[zero_bytes], &buf[zero_bytes + rand_bytes], []() { return (char) (random() & 0xff); });
-        b.appendBinData("padding", Collection::padding, mongo::BinDataGeneral, buf.get());
-    }
+BSONObj a_shape() {
+    return BSON("a" << 0LL);
 }
 
-static inline BSONObj random_obj() {
+/** {a: {$in: [k1, ..., kn]}} */
+BSONObj a_in_shape(size_t n) {
     BSONObjBuilder b;
-    _random_obj(b, true, true);
+    BSONObjBuilder ab(b.subobjStart("a"));
+    mongo::BSONArrayBuilder inb(ab.subarrayStart("$in"));
+    for (size_t i = 0; i < n; ++i) {
+        inb.append(0LL);
+    }
+    inb.doneFast();
+    ab.doneFast();
     return b.obj();
 }
 
-BSONObj random_a() {
+BSONObj a_range_shape() {
+    return BSON("a" << BSON("$gte" << 0LL << "$lt" << 0LL));
+}
+
+bson_template::slot_width field_width() {
+    // appendIntOrLL() in _random_obj makes anything under INT_MAX / 2 an int.
+    return Collection::documents <= (size_t) std::numeric_limits<int>::max() / 2 ? bson_template::int32 : bson_template::int64;
+}
+
+/** {$inc: {a: ..., b: ..., ...}}, one slot per field in field order; see field_width() for their type. */
+BSONObj inc_shape() {
     BSONObjBuilder b;
-    b.appendIntOrLL("a", random() % Collection::documents);
+    BSONObjBuilder incb(b.subobjStart("$inc"));
+    const Schema &schema = Schema::get();
+    for (size_t i = 0; i < Collection::fields; ++i) {
+        incb.append(schema.field(i), 0LL);
+    }
+    incb.doneFast();
     return b.obj();
 }
 
 void Collection::drop() {
+    if (_opts.backend == BackendType::mock) {
+        MockStore::get(ns(), documents).drop();
+        return;
+    }
     conn().dropCollection(ns());
 }
 
@@ -125,8 +148,8 @@ vector<BSONObj> Collection::index_specs() const {
                     [this, &i]() {
                         BSONObjBuilder b;
                         b << "ns" << ns()
-                          << "key" << index_spec(i)
-                          << "name" << index_name(i);
+                          << "key" << Schema::get().index_spec(i)
+                          << "name" << Schema::get().index_name(i);
                         if (is_tokumx()) {
                             b << "compression" << "zlib"
                               << "readPageSize" << (128 << 10);
@@ -166,8 +189,14 @@ void Collection::ensure_indexes() {
 void Collection::fill() {
     static std::mutex output_mutex;
 
+    // We're on a thread of our own, and the first writer.
+    Placement::get().enter_next();
+
+    const bool mock = _opts.backend == BackendType::mock;
     unique_ptr<RemoteLoader> loader;
-    if (_opts.loader) {
+    if (mock) {
+        // Nothing to create: mock collections come into being on first use, with no indexes.
+    } else if (_opts.loader) {
         BSONObjBuilder options;
         create_options(options);
         loader.reset(new RemoteLoader(conn(), dbname(), collname(), index_specs(), options.done()));
@@ -177,41 +206,153 @@ void Collection::fill() {
 
     Queue<shared_ptr<vector<BSONObj> > > objs_queue(100);
 
-    try {
-        static const size_t batch = 1<<17;
-        std::thread producer([&objs_queue, this]() {
-                try {
-                    for (size_t i = 0; i < Collection::documents; interrupter.check_for_interrupt()) {
-                        size_t this_batch = std::min(batch, Collection::documents - i);
-                        shared_ptr<vector<BSONObj> > vec(new vector<BSONObj>(this_batch));
-                        std::generate(vec->begin(), vec->end(), random_obj);
-                        objs_queue.push(vec);
-                        i += this_batch;
+    static const size_t batch = 1<<17;
+    const size_t nbatches = (Collection::documents + batch - 1) / batch;
+
+    // Generators claim batch numbers from next_batch.  In ordered mode, each
+    // waits for next_push to reach its batch before handing it over, so the
+    // inserter sees batches in the order they were claimed.
+    std::atomic<size_t> next_batch(0);
+    std::atomic<size_t> live_generators(generator_threads);
+    std::atomic_bool abort(false);
+    std::mutex order_mutex;
+    std::condition_variable order_cond;
+    size_t next_push = 0;
+
+    vector<std::thread> generators;
+    for (size_t g = 0; g < generator_threads; ++g) {
+        generators.push_back(std::thread([&]() {
+                    Placement::get().enter_next();
+                    try {
+                        DocGenerator gen;
+                        for (size_t k; (k = next_batch++) < nbatches && !abort; ) {
+                            interrupter.check_for_interrupt();
+                            size_t this_batch = std::min(batch, Collection::documents - k * batch);
+                            shared_ptr<vector<BSONObj> > vec(new vector<BSONObj>);
+                            vec->reserve(this_batch);
+                            std::generate_n(std::back_inserter(*vec), this_batch, std::ref(gen));
+                            if (ordered_fill) {
+                                std::unique_lock<std::mutex> lk(order_mutex);
+                                while (next_push != k) {
+                                    order_cond.wait_for(lk, std::chrono::milliseconds(100));
+                                    interrupter.check_for_interrupt();
+                                    if (abort) {
+                                        throw interrupt_exception();
+                                    }
+                                }
+                                objs_queue.push(vec);
+                                ++next_push;
+                                order_cond.notify_all();
+                            } else {
+                                objs_queue.push(vec);
+                            }
+                        }
+                    } catch (interrupt_exception) {
                     }
-                } catch (interrupt_exception) {
-                }
-            });
-        producer.detach();
+                    --live_generators;
+                }));
+    }
 
-        using out::ofs;
-        using out::ors;
+    // Unblocks any generator stuck on a full queue, and waits for them all to exit.
+    auto stop_generators = [&]() {
+        abort = true;
+        while (live_generators > 0) {
+            objs_queue.drain();
+            usleep(1000);
+        }
+        std::for_each(generators.begin(), generators.end(), std::mem_fn(&std::thread::join));
+        objs_queue.drain();
+    };
 
-        timestamp_t t0 = now();
-        counter<size_t> i(t0);
-        for (; i < Collection::documents; interrupter.check_for_interrupt()) {
-            size_t this_batch = std::min(batch, Collection::documents - i);
-            shared_ptr<vector<BSONObj> > objs = objs_queue.front();
-            objs_queue.pop();
-            conn().insert(ns(), *objs);
-            i += this_batch;
+    using out::ofs;
+    using out::ors;
 
-            {
-                std::lock_guard<std::mutex> lk(output_mutex);
-                cout << out::pad(18) << ns() << ofs
-                     << out::pad(10) << "fill" << ofs
-                     << i.report(now()) << ors;
+    // The loader is bound to conn(), so it can only be fed by one writer.
+    size_t nwriters = std::max<size_t>(writers, 1);
+    if (loader && nwriters > 1) {
+        std::lock_guard<std::mutex> lk(output_mutex);
+        cerr << "--fill.writers=" << nwriters << " is ignored with --loader, using 1 writer" << endl;
+        nwriters = 1;
+    }
+
+    timestamp_t t0 = now();
+    counter<size_t> i(t0);
+
+    // Writers claim batches from claimed_batches so they stop after exactly
+    // nbatches, then wait on the queue for whichever batch comes next.
+    std::atomic<size_t> claimed_batches(0);
+    std::exception_ptr writer_error;
+    std::mutex error_mutex;
+    // Keeps the first writer's exception to rethrow here, and stops the rest.
+    auto fail = [&]() {
+        std::lock_guard<std::mutex> lk(error_mutex);
+        if (!writer_error) {
+            writer_error = std::current_exception();
+        }
+        abort = true;
+    };
+    auto write = [&](Backend &c) {
+        try {
+            while (claimed_batches++ < nbatches && !abort) {
+                shared_ptr<vector<BSONObj> > objs;
+                while (!objs_queue.pop_for(objs, std::chrono::milliseconds(100))) {
+                    interrupter.check_for_interrupt();
+                    if (abort) {
+                        return;
+                    }
+                }
+                c.insert(ns(), *objs);
+                i += objs->size();
+
+                {
+                    std::lock_guard<std::mutex> lk(output_mutex);
+                    cout << out::pad(18) << ns() << ofs
+                         << out::pad(10) << "fill" << ofs
+                         << i.report(now()) << ors;
+                }
             }
+        } catch (interrupt_exception) {
+            abort = true;
+        } catch (...) {
+            fail();
         }
+    };
+
+    try {
+        vector<std::thread> extra_writers;
+        for (size_t w = 1; w < nwriters; ++w) {
+            extra_writers.push_back(std::thread([&]() {
+                        Placement::get().enter_next();
+                        if (mock) {
+                            MockBackend b(documents);
+                            write(b);
+                            return;
+                        }
+                        try {
+                            unique_ptr<mongo::ScopedDbConnection> c(mongo::ScopedDbConnection::getScopedDbConnection(_opts.host));
+                            MongoBackend b;
+                            b.reset(&c->conn());
+                            write(b);
+                            c->done();
+                        } catch (...) {
+                            fail();
+                        }
+                    }));
+        }
+        if (mock) {
+            MockBackend b(documents);
+            write(b);
+        } else {
+            MongoBackend b;
+            b.reset(&conn());
+            write(b);
+        }
+        std::for_each(extra_writers.begin(), extra_writers.end(), std::mem_fn(&std::thread::join));
+        interrupter.check_for_interrupt();
+        if (writer_error) {
+            std::rethrow_exception(writer_error);
+        }
+        stop_generators();
 
         if (loader) {
             interrupter.check_for_interrupt();
@@ -224,58 +365,394 @@ void Collection::fill() {
             }
         }
     } catch (interrupt_exception) {
-        objs_queue.drain();
+        stop_generators();
+    } catch (...) {
+        stop_generators();
+        throw;
     }
 }
 
+size_t Collection::generator_threads = 1;
+bool Collection::ordered_fill = true;
+size_t Collection::writers = 1;
+po::options_description Collection::fill_options_description() {
+    po::options_description desc("Fill");
+    desc.add_options()
+            ("fill.generator_threads", po::value(&generator_threads)->default_value(generator_threads), "# of threads generating documents for each collection.")
+            ("fill.ordered",           po::value(&ordered_fill)->default_value(ordered_fill),           "Insert generated batches in the order they were started.  With more than one generator thread, _ids within and across batches still interleave.")
+            ("fill.writers",           po::value(&writers)->default_value(writers),                     "# of connections inserting into each collection at once (only 1 with --loader).")
+            ;
+    return desc;
+}
 
 size_t UpdateRunner::threads = 0;
-void UpdateRunner::step(mongo::DBClientBase &conn) {
-    BSONObj spec = random_a();
-    BSONObjBuilder b;
-    BSONObjBuilder incb(b.subobjStart("$inc"));
-    _random_obj(incb, false, false);
-    incb.doneFast();
+double UpdateRunner::rate = 0;
+Distribution UpdateRunner::distribution;
+WriteConcern UpdateRunner::write_concern = WriteConcern::acknowledged;
+size_t UpdateRunner::batch = 1;
 
-    {
-        alarm a;
-        conn.update(ns(), spec, b.done());
-        conn.getLastError();
+UpdateStep::UpdateStep(CollectionRunner &runner, bool mixed) : Step(runner, mixed), _keys(UpdateRunner::distribution, Collection::documents), _query(a_shape()), _update(inc_shape(), field_width()) {}
+
+bool UpdateStep::splits() {
+    return UpdateRunner::batch > 1 || UpdateRunner::write_concern != WriteConcern::acknowledged;
+}
+
+void UpdateStep::step(Backend &conn) {
+    const size_t batch = UpdateRunner::batch;
+    const WriteConcern write_concern = UpdateRunner::write_concern;
+    const bool acked = write_concern != WriteConcern::unacknowledged;
+    const bool split = splits();
+    _sent.clear();
+    for (size_t n = 0; n < batch; ++n) {
+        const long long k = _keys(_rng);
+        _query.set(0, k);
+        for (size_t i = 0; i < _update.slots(); ++i) {
+            _update.set(i, _rng.uniform(Collection::documents));
+        }
+
+        set_request(k, _query.obj());
+        const timestamp_t t0 = split ? now() : 0;
+        conn.update(ns(), _query.obj(), _update.obj());
+        if (split && !acked) {
+            record(1, now() - t0);
+        } else if (split) {
+            _sent.push_back(t0);
+        }
+    }
+    if (!acked) {
+        return;
+    }
+
+    const timestamp_t t0 = split ? now() : 0;
+    conn.ack(write_concern);
+    if (split) {
+        // A write isn't done until the ack that covers it is back.
+        const timestamp_t t1 = now();
+        record(2, t1 - t0);
+        for (auto it = _sent.begin(); it != _sent.end(); ++it) {
+            record(1, t1 - *it);
+        }
     }
 }
 
+std::istream &operator>>(std::istream &is, BatchMode &mode) {
+    string s;
+    is >> s;
+    if (s == "in") {
+        mode = BatchMode::in;
+    } else if (s == "multiget") {
+        mode = BatchMode::multiget;
+    } else {
+        is.setstate(std::ios_base::failbit);
+    }
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const BatchMode &mode) {
+    return os << (mode == BatchMode::in ? "in" : "multiget");
+}
+
 size_t PointQueryRunner::threads = 0;
-void PointQueryRunner::step(mongo::DBClientBase &conn) {
-    BSONObj spec = random_a();
-    {
-        alarm a;
-        auto_ptr<mongo::DBClientCursor> c = conn.query(ns(), spec);
-        while (c->more()) {
-            c->next();
+double PointQueryRunner::rate = 0;
+Distribution PointQueryRunner::distribution;
+size_t PointQueryRunner::batch = 1;
+BatchMode PointQueryRunner::batch_mode = BatchMode::in;
+
+PointQueryStep::PointQueryStep(CollectionRunner &runner, bool mixed) : Step(runner, mixed), _keys(PointQueryRunner::distribution, Collection::documents), _query(a_shape()), _in_query(a_in_shape(PointQueryRunner::batch_mode == BatchMode::in ? PointQueryRunner::batch : 1)) {}
+
+void PointQueryStep::step(Backend &conn) {
+    const size_t batch = PointQueryRunner::batch;
+    const BatchMode batch_mode = PointQueryRunner::batch_mode;
+    if (batch > 1 && batch_mode == BatchMode::in) {
+        for (size_t i = 0; i < batch; ++i) {
+            _in_query.set(i, _keys(_rng));
+        }
+        set_request(-1, _in_query.obj());
+        timestamp_t t0 = now();
+        add_docs(conn.query(ns(), _in_query.obj(), ReadOptions(), [](const BSONObj &) {}));
+        record(1, (now() - t0) / batch, batch);
+        return;
+    }
+
+    for (size_t i = 0; i < batch; ++i) {
+        const long long k = _keys(_rng);
+        _query.set(0, k);
+        set_request(k, _query.obj());
+        timestamp_t t0 = now();
+        add_docs(conn.query(ns(), _query.obj(), ReadOptions(), [](const BSONObj &) {}));
+        if (batch > 1) {
+            record(1, now() - t0);
         }
     }
 }
 
-long long RangeQueryRunner::bytes = 0;
 size_t RangeQueryRunner::threads = 0;
+double RangeQueryRunner::rate = 0;
+Distribution RangeQueryRunner::distribution;
 size_t RangeQueryRunner::stride = 0;
+Distribution RangeQueryRunner::width(Distribution::constant);
 bool RangeQueryRunner::covered = false;
-void RangeQueryRunner::step(mongo::DBClientBase &conn) {
-    long long x = random() % (Collection::documents - stride);
-    long long y = x + stride;
+int RangeQueryRunner::batch_size = 0;
+int RangeQueryRunner::limit = 0;
+bool RangeQueryRunner::exhaust = false;
+
+RangeQueryStep::RangeQueryStep(CollectionRunner &runner, bool mixed) : Step(runner, mixed), _keys(RangeQueryRunner::distribution, Collection::documents - RangeQueryRunner::stride), _widths(RangeQueryRunner::width, RangeQueryRunner::stride), _query(a_range_shape()) {}
+
+void RangeQueryStep::step(Backend &conn) {
+    const size_t stride = RangeQueryRunner::stride;
+    long long x = _keys(_rng);
+    long long w = stride == 0 ? 0 : 1 + _widths(_rng);
+    _query.set(0, x);
+    _query.set(1, x + w);
     static const BSONObj covered_projection = BSON("_id" << 0 << "a" << 1);
-    {
-        alarm a;
+    ReadOptions ro;
+    ro.fields = RangeQueryRunner::covered ? &covered_projection : NULL;
+    ro.limit = RangeQueryRunner::limit;
+    ro.batch_size = RangeQueryRunner::batch_size;
+    ro.exhaust = RangeQueryRunner::exhaust;
+    set_request(x, _query.obj());
+    add_docs(conn.query(ns(), _query.obj(), ro, [this](const BSONObj &o) { add_bytes(o.objsize()); }));
+}
+
+size_t IndexQueryRunner::threads = 0;
+double IndexQueryRunner::rate = 0;
+Distribution IndexQueryRunner::distribution;
+Distribution IndexQueryRunner::index_distribution;
+size_t IndexQueryRunner::prefix = 1;
+size_t IndexQueryRunner::stride = 0;
+bool IndexQueryRunner::covered = false;
+
+IndexQueryStep::IndexQueryStep(CollectionRunner &runner, bool mixed)
+        : Step(runner, mixed),
+          _keys(IndexQueryRunner::distribution, Collection::documents - IndexQueryRunner::stride),
+          _indexes(IndexQueryRunner::index_distribution, Schema::get().indexes()) {
+    const size_t prefix = IndexQueryRunner::prefix;
+    const size_t stride = IndexQueryRunner::stride;
+    const Schema &schema = Schema::get();
+    for (size_t n = 0; n < schema.indexes(); ++n) {
+        const BSONObj &spec = schema.index_spec(n);
+        const size_t nfields = std::min<size_t>(std::max<size_t>(prefix, 1), spec.nFields());
+
+        // {$query: {f1: k1, ..., fn: kn or {$gte: kn, $lt: kn + stride}}, $hint: spec}
         BSONObjBuilder qb;
-        BSONObjBuilder rgb(qb.subobjStart("a"));
-        rgb.append("$gte", x);
-        rgb.append("$lt", y);
-        rgb.doneFast();
-        auto_ptr<mongo::DBClientCursor> c = conn.query(ns(), qb.done(), 0, 0, covered ? &covered_projection : NULL);
-        while (c->more()) {
-            bytes += c->next().objsize();
+        BSONObjBuilder pb;
+        pb.append("_id", 0);
+        mongo::BSONObjIterator it(spec);
+        for (size_t i = 0; i < nfields; ++i) {
+            const char *f = it.next().fieldName();
+            if (i == nfields - 1 && stride > 0) {
+                qb.append(f, BSON("$gte" << 0LL << "$lt" << 0LL));
+            } else {
+                qb.append(f, 0LL);
+            }
+        }
+        mongo::BSONObjIterator all(spec);
+        while (all.more()) {
+            pb.append(all.next().fieldName(), 1);
+        }
+        _queries.push_back(unique_ptr<bson_template>(new bson_template(BSON("$query" << qb.obj() << "$hint" << spec))));
+        _projections.push_back(pb.obj());
+        _op_names.push_back("ix." + schema.index_name(n));
+    }
+}
+
+void IndexQueryStep::step(Backend &conn) {
+    const size_t stride = IndexQueryRunner::stride;
+    const size_t n = _indexes(_rng);
+    set_op(n);
+    bson_template &q = *_queries[n];
+    const size_t nkeys = stride > 0 ? q.slots() - 1 : q.slots();
+    long long first = -1;
+    for (size_t i = 0; i < nkeys; ++i) {
+        // The first field's value decides where in the index we land, so
+        // it follows the key distribution; the rest are uniform.
+        long long k = i == 0 ? _keys(_rng) : _rng.uniform(Collection::documents - stride);
+        q.set(i, k);
+        if (i == 0) {
+            first = k;
+        }
+        if (stride > 0 && i == nkeys - 1) {
+            q.set(i + 1, k + stride);
+        }
+    }
+    set_request(first, q.obj());
+    ReadOptions ro;
+    ro.fields = IndexQueryRunner::covered ? &_projections[n] : NULL;
+    add_docs(conn.query(ns(), q.obj(), ro, [this](const BSONObj &o) { add_bytes(o.objsize()); }));
+}
+
+size_t InsertRunner::threads = 0;
+double InsertRunner::rate = 0;
+size_t InsertRunner::batch = 1;
+void InsertStep::step(Backend &conn) {
+    _batch.clear();
+    std::generate_n(std::back_inserter(_batch), InsertRunner::batch, std::ref(_gen));
+    conn.insert(ns(), _batch);
+    conn.ack();
+}
+
+/**
+ * Deletes the first document with a >= k, or if there are none, the
+ * last one with a < k, so a delete almost never misses.  A delete's
+ * selector can't be sorted, so that last one is looked up first and
+ * then removed by _id (and a, to keep it to one shard of the mock).
+ * @return whether a document was deleted.
+ */
+static bool remove_near(Backend &conn, const string &ns, long long k) {
+    conn.remove(ns, a_cmp_spec("$gte", k), true);
+    if (conn.ack() > 0) {
+        return true;
+    }
+    static const BSONObj fields = BSON("_id" << 1 << "a" << 1);
+    ReadOptions ro;
+    ro.fields = &fields;
+    ro.limit = 1;
+    BSONObj last;
+    conn.query(ns, BSON("$query" << a_cmp_spec("$lt", k) << "$orderby" << BSON("a" << -1)), ro, [&last](const BSONObj &o) { last = o.getOwned(); });
+    if (last.isEmpty()) {
+        return false;
+    }
+    conn.remove(ns, last, true);
+    return conn.ack() > 0;
+}
+
+size_t DeleteRunner::threads = 0;
+double DeleteRunner::rate = 0;
+Distribution DeleteRunner::distribution;
+
+DeleteStep::DeleteStep(CollectionRunner &runner, bool mixed) : Step(runner, mixed), _keys(DeleteRunner::distribution, Collection::documents) {}
+
+void DeleteStep::step(Backend &conn) {
+    const long long k = _keys(_rng);
+    set_request(k);
+    remove_near(conn, ns(), k);
+}
+
+size_t ChurnRunner::threads = 0;
+double ChurnRunner::rate = 0;
+Distribution ChurnRunner::distribution;
+size_t ChurnRunner::batch = 1;
+
+ChurnStep::ChurnStep(CollectionRunner &runner, bool mixed) : Step(runner, mixed), _keys(ChurnRunner::distribution, Collection::documents) {}
+
+void ChurnStep::step(Backend &conn) {
+    const size_t batch = ChurnRunner::batch;
+    _batch.clear();
+    std::generate_n(std::back_inserter(_batch), batch, std::ref(_gen));
+    conn.insert(ns(), _batch);
+    conn.ack();
+    for (size_t i = 0; i < batch; ++i) {
+        const long long k = _keys(_rng);
+        set_request(k);
+        remove_near(conn, ns(), k);
+    }
+}
+
+template<class Runner>
+static RunnerType runner_type(const string &section) {
+    RunnerType t;
+    t.section = section;
+    t.threads = &Runner::threads;
+    t.rate = &Runner::rate;
+    t.make = [](const Options &opts, const string &ns, size_t id, timestamp_t t0) -> CollectionRunner * {
+        return new Runner(opts, ns, id, t0);
+    };
+    return t;
+}
+
+/** @return a RunnerType whose steps MixedRunner can use too. */
+template<class Runner, class RunnerStep>
+static RunnerType mixable_runner_type(const string &section) {
+    RunnerType t = runner_type<Runner>(section);
+    t.make_step = [](CollectionRunner &runner) -> Step * {
+        return new RunnerStep(runner, true);
+    };
+    return t;
+}
+
+const vector<RunnerType> &runner_types() {
+    static const vector<RunnerType> types = {
+        mixable_runner_type<UpdateRunner, UpdateStep>("update"),
+        mixable_runner_type<PointQueryRunner, PointQueryStep>("point_query"),
+        mixable_runner_type<RangeQueryRunner, RangeQueryStep>("range_query"),
+        mixable_runner_type<IndexQueryRunner, IndexQueryStep>("index_query"),
+        runner_type<MixedRunner>("mixed"),
+        mixable_runner_type<InsertRunner, InsertStep>("insert"),
+        mixable_runner_type<DeleteRunner, DeleteStep>("delete"),
+        mixable_runner_type<ChurnRunner, ChurnStep>("churn"),
+    };
+    return types;
+}
+
+const RunnerType *find_runner_type(const string &section) {
+    const vector<RunnerType> &types = runner_types();
+    for (auto it = types.begin(); it != types.end(); ++it) {
+        if (it->section == section) {
+            return &*it;
+        }
+    }
+    return NULL;
+}
+
+std::istream &operator>>(std::istream &is, OpWeights &w) {
+    string s;
+    is >> s;
+    std::replace(s.begin(), s.end(), ',', ' ');
+    std::replace(s.begin(), s.end(), ':', ' ');
+    stringstream ss(s);
+
+    OpWeights r;
+    double sum = 0;
+    string name;
+    double weight;
+    while (ss >> name) {
+        const RunnerType *type = find_runner_type(name);
+        if (!(ss >> weight) || weight < 0 || type == NULL || !type->make_step) {
+            is.setstate(std::ios_base::failbit);
+            return is;
+        }
+        r.ops.push_back(std::make_pair(name, weight));
+        sum += weight;
+    }
+    if (sum <= 0) {
+        is.setstate(std::ios_base::failbit);
+        return is;
+    }
+    w = r;
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const OpWeights &w) {
+    for (auto it = w.ops.begin(); it != w.ops.end(); ++it) {
+        if (it != w.ops.begin()) {
+            os << ",";
         }
+        os << it->first << ":" << it->second;
+    }
+    return os;
+}
+
+size_t MixedRunner::threads = 0;
+double MixedRunner::rate = 0;
+OpWeights MixedRunner::weights = {{"update", 25}, {"point_query", 70}, {"range_query", 5}};
+MixedRunner::MixedRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0) {
+    set_rate(rate, threads);
+    double sum = 0;
+    for (auto it = weights.ops.begin(); it != weights.ops.end(); ++it) {
+        _steps.push_back(unique_ptr<Step>(find_runner_type(it->first)->make_step(*this)));
+        _op_names.push_back("m." + it->first);
+        sum += it->second;
+        _cumulative.push_back(sum);
     }
+    set_op_types(_steps.size());
+}
+
+void MixedRunner::step(Backend &conn) {
+    const double x = _rng.real() * _cumulative.back();
+    size_t op = std::upper_bound(_cumulative.begin(), _cumulative.end(), x) - _cumulative.begin();
+    op = std::min(op, _steps.size() - 1);
+    set_op(op);
+    _steps[op]->step(conn);
 }
 
 } // namespace cortisol
@@ -2,79 +2,533 @@
 
 #pragma once
 
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "mongo/client/dbclient.h"
 
+#include "bson_template.h"
 #include "collection.h"
+#include "distribution.h"
 
 namespace cortisol {
 
 namespace po = boost::program_options;
 
+using std::pair;
+using std::unique_ptr;
+using std::vector;
+
+/** Shapes for the runners' bson_templates, see cortisol.cpp. */
+mongo::BSONObj a_shape();
+mongo::BSONObj a_in_shape(size_t n);
+mongo::BSONObj a_range_shape();
+mongo::BSONObj inc_shape();
+/** @return the width fill gives field values, for templates that write them. */
+bson_template::slot_width field_width();
+
+/**
+ * One kind of operation: its per-thread state (key generators,
+ * templates, buffers) and the step that uses it.  The runner that does
+ * only this kind of op has one, and so does a MixedRunner for each kind
+ * it mixes.  Everything a step measures goes to the runner it was made
+ * for, except that in a mix, whose stats only have room for whole steps,
+ * set_op() and record() are dropped.
+ */
+class Step {
+    CollectionRunner &_runner;
+    const bool _mixed;
+
+  protected:
+    rng &_rng;
+
+    Step(CollectionRunner &runner, bool mixed) : _runner(runner), _mixed(mixed), _rng(runner._rng) {}
+
+    const string &ns() const {
+        return _runner.ns();
+    }
+    void set_op(size_t op) {
+        if (!_mixed) {
+            _runner.set_op(op);
+        }
+    }
+    void set_request(long long key, const BSONObj &request = BSONObj()) {
+        _runner.set_request(key, request);
+    }
+    void add_bytes(uint64_t n) {
+        _runner.add_bytes(n);
+    }
+    void add_docs(uint64_t n) {
+        _runner.add_docs(n);
+    }
+    void record(size_t op, timestamp_t latency, uint64_t n = 1) {
+        if (!_mixed) {
+            _runner.record(op, latency, n);
+        }
+    }
+
+  public:
+    Step(const Step&) = delete;
+    Step& operator=(const Step&) = delete;
+    virtual ~Step() {}
+
+    virtual void step(Backend &conn) = 0;
+};
+
+/** A kind of stressor, by its config section, and how to make its runners. */
+class RunnerType {
+  public:
+    string section;        // config section, e.g. "point_query", also its name in mixed.weights
+    const size_t *threads;
+    const double *rate;
+    std::function<CollectionRunner *(const Options &, const string &, size_t, timestamp_t)> make;
+    std::function<Step *(CollectionRunner &)> make_step;  // for MixedRunner, empty if it can't be mixed
+
+    size_t phase_threads(const Phase &phase) const {
+        auto it = phase.threads.find(section);
+        return it == phase.threads.end() ? *threads : it->second;
+    }
+    double phase_rate(const Phase &phase) const {
+        auto it = phase.rates.find(section);
+        return it == phase.rates.end() ? *rate : it->second;
+    }
+};
+
+/** @return every kind of stressor, in the order they're started. */
+const vector<RunnerType> &runner_types();
+/** @return the kind of stressor configured in section, or NULL if there is none. */
+const RunnerType *find_runner_type(const string &section);
+
+/**
+ * Sends update.batch updates per step, then one getLastError for the
+ * lot with update.write_concern (or none, if unacknowledged).  Unless
+ * that's the default of one acknowledged update, whole steps are
+ * reported as "update", each write as "update.write" (from when it was
+ * sent until the ack that covers it, or just the send if unacknowledged)
+ * and each getLastError round trip as "update.ack".
+ */
+class UpdateStep : public Step {
+    key_generator _keys;
+    bson_template _query;
+    bson_template _update;
+    vector<timestamp_t> _sent;
+  public:
+    UpdateStep(CollectionRunner &runner, bool mixed);
+    void step(Backend &conn);
+
+    /** @return whether writes and acks are reported separately. */
+    static bool splits();
+};
+
 class UpdateRunner : public CollectionRunner {
+    UpdateStep _step;
   public:
-    UpdateRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0) {}
-    void step(mongo::DBClientBase &conn);
+    UpdateRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0), _step(*this, false) {
+        if (UpdateStep::splits()) {
+            set_op_types(write_concern == WriteConcern::unacknowledged ? 2 : 3);
+        }
+        set_rate(rate, threads);
+    }
+    void step(Backend &conn) {
+        _step.step(conn);
+    }
 
     virtual const string &name() const {
         static const string n = "update";
         return n;
     }
 
+    virtual const string &op_name(size_t op) const {
+        static const string names[] = {"update", "update.write", "update.ack"};
+        return names[op];
+    }
+
     // config
     static size_t threads;
+    static double rate;
+    static Distribution distribution;
+    static WriteConcern write_concern;
+    static size_t batch;
     static po::options_description options_description() {
         po::options_description desc("Update Thread");
         desc.add_options()
                 ("update.threads", po::value(&threads)->default_value(threads), "# of threads.")
+                ("update.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads, where an op is update.batch updates and their getLastError (0 = as fast as possible).")
+                ("update.distribution", po::value(&distribution)->default_value(distribution), "Key distribution: uniform, zipfian[:theta], latest[:theta] or hotspot[:ops:keys].")
+                ("update.write_concern", po::value(&write_concern)->default_value(write_concern), "What each op's getLastError waits for: unacknowledged (no getLastError), acknowledged, journaled (j: true) or majority (w: \"majority\").")
+                ("update.batch",   po::value(&batch)->default_value(batch),     "# of updates sent per getLastError (at least 1).")
                 ;
         return desc;
     }
 };
 
+/** How PointQueryRunner looks up a batch of keys. */
+enum class BatchMode {
+    in,       // one query, {a: {$in: [k1, ..., kN]}}
+    multiget  // N queries back to back on the same connection
+};
+
+std::istream &operator>>(std::istream &is, BatchMode &mode);
+std::ostream &operator<<(std::ostream &os, const BatchMode &mode);
+
+/**
+ * Looks up point_query.batch keys per step.  With a batch of more than one
+ * key, whole batches are reported as "ptquery" and single keys as
+ * "ptquery.key": in $in mode each key is charged an equal share of the
+ * batch's latency, in multiget mode its own round trip.
+ */
+class PointQueryStep : public Step {
+    key_generator _keys;
+    bson_template _query;
+    bson_template _in_query;
+  public:
+    PointQueryStep(CollectionRunner &runner, bool mixed);
+    void step(Backend &conn);
+};
+
 class PointQueryRunner : public CollectionRunner {
+    PointQueryStep _step;
   public:
-    PointQueryRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0) {}
-    void step(mongo::DBClientBase &conn);
+    PointQueryRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0), _step(*this, false) {
+        if (batch > 1) {
+            set_op_types(2);
+        }
+        set_rate(rate, threads);
+    }
+    void step(Backend &conn) {
+        _step.step(conn);
+    }
 
     virtual const string &name() const {
         static const string n = "ptquery";
         return n;
     }
 
+    virtual const string &op_name(size_t op) const {
+        static const string key = "ptquery.key";
+        return op == 0 ? name() : key;
+    }
+
     // config
     static size_t threads;
+    static double rate;
+    static Distribution distribution;
+    static size_t batch;
+    static BatchMode batch_mode;
     static po::options_description options_description() {
         po::options_description desc("Point Query Thread");
         desc.add_options()
                 ("point_query.threads", po::value(&threads)->default_value(threads), "# of threads.")
+                ("point_query.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads (0 = as fast as possible).")
+                ("point_query.distribution", po::value(&distribution)->default_value(distribution), "Key distribution: uniform, zipfian[:theta], latest[:theta] or hotspot[:ops:keys].")
+                ("point_query.batch", po::value(&batch)->default_value(batch), "Keys looked up per op (at least 1).")
+                ("point_query.batch_mode", po::value(&batch_mode)->default_value(batch_mode), "How to look up a batch: in (one $in query) or multiget (one query per key).")
                 ;
         return desc;
     }
 };
 
+/**
+ * Scans a range of keys [k, k + w), with w drawn from range_query.width
+ * over [1, stride] (by default always stride), and counts the documents
+ * and bytes that come back.
+ */
+class RangeQueryStep : public Step {
+    key_generator _keys;
+    key_generator _widths;
+    bson_template _query;
+  public:
+    RangeQueryStep(CollectionRunner &runner, bool mixed);
+    void step(Backend &conn);
+};
+
 class RangeQueryRunner : public CollectionRunner {
+    RangeQueryStep _step;
   public:
-    RangeQueryRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0) {}
-    void step(mongo::DBClientBase &conn);
+    RangeQueryRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0), _step(*this, false) {
+        set_rate(rate, threads);
+    }
+    void step(Backend &conn) {
+        _step.step(conn);
+    }
 
     virtual const string &name() const {
         static const string n = "rgquery";
         return n;
     }
 
-    // stats
-    static long long bytes;
-
     // config
     static size_t threads;
+    static double rate;
+    static Distribution distribution;
     static size_t stride;
+    static Distribution width;
     static bool covered;
+    static int batch_size;
+    static int limit;
+    static bool exhaust;
     static po::options_description options_description() {
         po::options_description desc("Range Query Thread");
         desc.add_options()
                 ("range_query.threads", po::value(&threads)->default_value(threads), "# of threads.")
-                ("range_query.stride",  po::value(&stride)->default_value(stride),   "# of docs to query at once.")
+                ("range_query.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads (0 = as fast as possible).")
+                ("range_query.distribution", po::value(&distribution)->default_value(distribution), "Distribution of range start keys: uniform, zipfian[:theta], latest[:theta] or hotspot[:ops:keys].")
+                ("range_query.stride",  po::value(&stride)->default_value(stride),   "Max # of docs to query at once (less than --documents).")
+                ("range_query.width",   po::value(&width)->default_value(width),     "Distribution of range widths over [1, stride]: constant (always stride), uniform, zipfian[:theta], latest[:theta] or hotspot[:ops:keys].")
                 ("range_query.covered", po::value(&covered)->default_value(covered), "Should the query be covered by the index?")
+                ("range_query.batch_size", po::value(&batch_size)->default_value(batch_size), "Cursor batch size (0 = server default).")
+                ("range_query.limit",   po::value(&limit)->default_value(limit),     "Max # of docs to return (0 = no limit).  Ignored with exhaust.")
+                ("range_query.exhaust", po::value(&exhaust)->default_value(exhaust), "Stream results with an exhaust cursor instead of a getMore per batch.")
+                ;
+        return desc;
+    }
+};
+
+/**
+ * Queries through the secondary indexes: each step picks index n (from
+ * index_query.index_distribution over the collection's indexes), hints
+ * it, and matches the first index_query.prefix fields of its key, all by
+ * equality or, with a stride, the last one by range.  Each index is
+ * reported separately, as "ix.<index name>".
+ */
+class IndexQueryStep : public Step {
+    key_generator _keys;
+    key_generator _indexes;
+    vector<unique_ptr<bson_template> > _queries;  // one per index
+    vector<mongo::BSONObj> _projections;          // one per index, for covered queries
+    vector<string> _op_names;
+
+  public:
+    IndexQueryStep(CollectionRunner &runner, bool mixed);
+    void step(Backend &conn);
+
+    /** @return what to report each index's queries as. */
+    const vector<string> &op_names() const {
+        return _op_names;
+    }
+};
+
+class IndexQueryRunner : public CollectionRunner {
+    IndexQueryStep _step;
+
+  public:
+    IndexQueryRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0), _step(*this, false) {
+        set_op_types(_step.op_names().size());
+        set_rate(rate, threads);
+    }
+    void step(Backend &conn) {
+        _step.step(conn);
+    }
+
+    virtual const string &name() const {
+        static const string n = "ixquery";
+        return n;
+    }
+
+    virtual const string &op_name(size_t op) const {
+        return _step.op_names()[op];
+    }
+
+    // config
+    static size_t threads;
+    static double rate;
+    static Distribution distribution;
+    static Distribution index_distribution;
+    static size_t prefix;
+    static size_t stride;
+    static bool covered;
+    static po::options_description options_description() {
+        po::options_description desc("Index Query Thread");
+        desc.add_options()
+                ("index_query.threads", po::value(&threads)->default_value(threads), "# of threads.")
+                ("index_query.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads (0 = as fast as possible).")
+                ("index_query.distribution", po::value(&distribution)->default_value(distribution), "Distribution of key values: uniform, zipfian[:theta], latest[:theta] or hotspot[:ops:keys].")
+                ("index_query.index_distribution", po::value(&index_distribution)->default_value(index_distribution), "Which indexes to query: uniform, zipfian[:theta], latest[:theta] or hotspot[:ops:keys] over the index numbers.")
+                ("index_query.prefix",  po::value(&prefix)->default_value(prefix),   "# of leading index fields to match (at most the index's own).")
+                ("index_query.stride",  po::value(&stride)->default_value(stride),   "If nonzero, match the last prefix field over a range of this many keys (less than --documents).")
+                ("index_query.covered", po::value(&covered)->default_value(covered), "Project only the index's fields, so the query is covered by it.")
+                ;
+        return desc;
+    }
+};
+
+/** Makes random documents to insert.  Not thread safe: each thread needs its own. */
+class DocGenerator {
+    rng _rng;
+    unique_ptr<char[]> _padding;
+  public:
+    DocGenerator();
+    BSONObj operator()();
+};
+
+class InsertStep : public Step {
+    DocGenerator _gen;
+    vector<BSONObj> _batch;
+  public:
+    InsertStep(CollectionRunner &runner, bool mixed) : Step(runner, mixed) {}
+    void step(Backend &conn);
+};
+
+class InsertRunner : public CollectionRunner {
+    InsertStep _step;
+  public:
+    InsertRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0), _step(*this, false) {
+        set_rate(rate, threads);
+    }
+    void step(Backend &conn) {
+        _step.step(conn);
+    }
+
+    virtual const string &name() const {
+        static const string n = "insert";
+        return n;
+    }
+
+    // config
+    static size_t threads;
+    static double rate;
+    static size_t batch;
+    static po::options_description options_description() {
+        po::options_description desc("Insert Thread");
+        desc.add_options()
+                ("insert.threads", po::value(&threads)->default_value(threads), "# of threads.")
+                ("insert.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads (0 = as fast as possible).")
+                ("insert.batch",   po::value(&batch)->default_value(batch),     "# of new documents per insert (at least 1).")
+                ;
+        return desc;
+    }
+};
+
+class DeleteStep : public Step {
+    key_generator _keys;
+  public:
+    DeleteStep(CollectionRunner &runner, bool mixed);
+    void step(Backend &conn);
+};
+
+class DeleteRunner : public CollectionRunner {
+    DeleteStep _step;
+  public:
+    DeleteRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0), _step(*this, false) {
+        set_rate(rate, threads);
+    }
+    void step(Backend &conn) {
+        _step.step(conn);
+    }
+
+    virtual const string &name() const {
+        static const string n = "delete";
+        return n;
+    }
+
+    // config
+    static size_t threads;
+    static double rate;
+    static Distribution distribution;
+    static po::options_description options_description() {
+        po::options_description desc("Delete Thread");
+        desc.add_options()
+                ("delete.threads", po::value(&threads)->default_value(threads), "# of threads.")
+                ("delete.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads (0 = as fast as possible).")
+                ("delete.distribution", po::value(&distribution)->default_value(distribution), "Key distribution: uniform, zipfian[:theta], latest[:theta] or hotspot[:ops:keys].")
+                ;
+        return desc;
+    }
+};
+
+/**
+ * Inserts a batch of new documents and then deletes as many existing
+ * ones, so the collection stays the same size while taking writes.
+ */
+class ChurnStep : public Step {
+    DocGenerator _gen;
+    vector<BSONObj> _batch;
+    key_generator _keys;
+  public:
+    ChurnStep(CollectionRunner &runner, bool mixed);
+    void step(Backend &conn);
+};
+
+class ChurnRunner : public CollectionRunner {
+    ChurnStep _step;
+  public:
+    ChurnRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0) : CollectionRunner(opts, ns, id, t0), _step(*this, false) {
+        set_rate(rate, threads);
+    }
+    void step(Backend &conn) {
+        _step.step(conn);
+    }
+
+    virtual const string &name() const {
+        static const string n = "churn";
+        return n;
+    }
+
+    // config
+    static size_t threads;
+    static double rate;
+    static Distribution distribution;
+    static size_t batch;
+    static po::options_description options_description() {
+        po::options_description desc("Churn Thread");
+        desc.add_options()
+                ("churn.threads", po::value(&threads)->default_value(threads), "# of threads.")
+                ("churn.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads (0 = as fast as possible).")
+                ("churn.distribution", po::value(&distribution)->default_value(distribution), "Distribution of keys to delete near.")
+                ("churn.batch",   po::value(&batch)->default_value(batch),     "# of documents inserted, and then deleted, per op (at least 1).")
+                ;
+        return desc;
+    }
+};
+
+/** Relative weights of runner types, by config section, written like "update:25,point_query:70,range_query:5". */
+class OpWeights {
+  public:
+    vector<pair<string, double> > ops;
+
+    OpWeights() {}
+    OpWeights(std::initializer_list<pair<string, double> > l) : ops(l) {}
+};
+
+std::istream &operator>>(std::istream &is, OpWeights &w);
+std::ostream &operator<<(std::ostream &os, const OpWeights &w);
+
+/**
+ * Does a weighted random mix of the other runners' steps on one
+ * connection, and reports each kind of operation separately.
+ */
+class MixedRunner : public CollectionRunner {
+    vector<unique_ptr<Step> > _steps;
+    vector<string> _op_names;
+    vector<double> _cumulative;
+  public:
+    MixedRunner(const Options &opts, const string &ns, size_t id, timestamp_t t0);
+    void step(Backend &conn);
+
+    virtual const string &name() const {
+        static const string n = "mixed";
+        return n;
+    }
+
+    virtual const string &op_name(size_t op) const {
+        return _op_names[op];
+    }
+
+    // config
+    static size_t threads;
+    static double rate;
+    static OpWeights weights;
+    static po::options_description options_description() {
+        po::options_description desc("Mixed Thread");
+        desc.add_options()
+                ("mixed.threads", po::value(&threads)->default_value(threads), "# of threads.")
+                ("mixed.rate",    po::value(&rate)->default_value(rate),       "Target ops/sec over all threads (0 = as fast as possible).")
+                ("mixed.weights", po::value(&weights)->default_value(weights), "Relative frequency of each operation, by config section, like update:25,point_query:70,range_query:5.")
                 ;
         return desc;
     }
@@ -0,0 +1,687 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "dist.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+
+#include "histogram.h"
+#include "output.h"
+#include "thread.h"
+#include "wire.h"
+
+namespace cortisol {
+
+using std::cerr;
+using std::endl;
+using std::shared_ptr;
+
+extern thread_interrupter interrupter;
+
+string Dist::listen;
+string Dist::coordinator;
+size_t Dist::workers = 1;
+bool Dist::spawn = false;
+double Dist::start_delay = 2.0;
+po::options_description Dist::options_description() {
+    po::options_description desc("Distributed");
+    desc.add_options()
+            ("dist.listen",      po::value(&listen)->default_value(listen),           "Coordinate a run over workers that connect here, \"unix:<path>\" or \"[host:]port\".")
+            ("dist.workers",     po::value(&workers)->default_value(workers),         "# of workers to wait for before starting.")
+            ("dist.spawn",       po::value(&spawn)->default_value(spawn),             "Start the workers on this host (listening on a unix socket in /tmp unless --dist.listen says otherwise).")
+            ("dist.coordinator", po::value(&coordinator)->default_value(coordinator), "Be a worker for the coordinator at this address, and take all other options from it.")
+            ("dist.start_delay", po::value(&start_delay)->default_value(start_delay), "Seconds between telling workers the start time and starting, for them to connect their runners.")
+            ;
+    return desc;
+}
+
+/**
+ * Messages between coordinator and workers, framed like wire protocol
+ * messages with the type in the op field.  The coordinator sends config
+ * and then start; workers answer config with ready or error, then send
+ * reports and finally their totals.  The coordinator stops workers early
+ * by hanging up.
+ */
+enum MessageType {
+    msg_config = 1,  // count + args, count + (name, contents) of config files
+    msg_ready,
+    msg_error,       // what went wrong
+    msg_start,       // int64 wall clock ns
+    msg_report,      // count + records
+    msg_totals       // count + records
+};
+
+/** Packs message bodies in host byte order, like BinaryWriter. */
+class Packer {
+  public:
+    string buf;
+
+    template<typename T>
+    void put(T x) {
+        buf.append(reinterpret_cast<const char *>(&x), sizeof x);
+    }
+    void put(const string &s) {
+        put<uint32_t>(s.size());
+        buf.append(s);
+    }
+    /** Just the buckets that aren't empty, as (index, count). */
+    void put(const histogram::snapshot &s) {
+        uint32_t n = 0;
+        for (size_t i = 0; i < histogram::nbuckets; ++i) {
+            n += s.bucket_count(i) != 0;
+        }
+        put<uint32_t>(n);
+        for (size_t i = 0; i < histogram::nbuckets; ++i) {
+            if (s.bucket_count(i) != 0) {
+                put<uint32_t>(i);
+                put<uint64_t>(s.bucket_count(i));
+            }
+        }
+    }
+    void put(const Record &r) {
+        put<uint8_t>(r.total);
+        put(r.phase);
+        put(r.ns);
+        put(r.type);
+        put<uint64_t>(r.id);
+        put<double>(r.period);
+        put<double>(r.elapsed);
+        put<uint64_t>(r.ops);
+        put<uint64_t>(r.c_ops);
+        put<uint64_t>(r.bytes);
+        put<uint64_t>(r.c_bytes);
+        put<uint64_t>(r.docs);
+        put<uint64_t>(r.c_docs);
+        put<uint64_t>(r.errors);
+        put<uint64_t>(r.c_errors);
+        put(r.latency);
+        put(r.c_latency);
+        put(r.late);
+        put(r.c_late);
+    }
+};
+
+/** Reads what a Packer packed.  Reading past the end throws. */
+class Unpacker {
+    const char *_p;
+    const char *_end;
+
+    void need(size_t n) const {
+        if (static_cast<size_t>(_end - _p) < n) {
+            throw std::runtime_error("short message");
+        }
+    }
+
+  public:
+    explicit Unpacker(const string &body) : _p(body.data()), _end(body.data() + body.size()) {}
+
+    template<typename T>
+    T get() {
+        T x;
+        need(sizeof x);
+        memcpy(&x, _p, sizeof x);
+        _p += sizeof x;
+        return x;
+    }
+    string get_string() {
+        const uint32_t n = get<uint32_t>();
+        need(n);
+        string s(_p, n);
+        _p += n;
+        return s;
+    }
+    void get(histogram::snapshot &s) {
+        for (uint32_t n = get<uint32_t>(); n > 0; --n) {
+            const uint32_t i = get<uint32_t>();
+            const uint64_t count = get<uint64_t>();
+            if (i >= histogram::nbuckets) {
+                throw std::runtime_error("bad histogram bucket");
+            }
+            s.add_bucket(i, count);
+        }
+    }
+    void get(Record &r) {
+        r.total = get<uint8_t>();
+        r.phase = get_string();
+        r.ns = get_string();
+        r.type = get_string();
+        r.id = get<uint64_t>();
+        r.period = get<double>();
+        r.elapsed = get<double>();
+        r.ops = get<uint64_t>();
+        r.c_ops = get<uint64_t>();
+        r.bytes = get<uint64_t>();
+        r.c_bytes = get<uint64_t>();
+        r.docs = get<uint64_t>();
+        r.c_docs = get<uint64_t>();
+        r.errors = get<uint64_t>();
+        r.c_errors = get<uint64_t>();
+        get(r.latency);
+        get(r.c_latency);
+        get(r.late);
+        get(r.c_late);
+    }
+};
+
+static bool send_message(int fd, int type, const string &body) {
+    wire::Header h = {static_cast<int32_t>(wire::header_size + body.size()), 0, 0, type};
+    string msg(reinterpret_cast<const char *>(&h), sizeof h);
+    msg += body;
+    const char *p = msg.data();
+    size_t n = msg.size();
+    while (n > 0) {
+        ssize_t w = ::send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+/** Reads one message.  @return false if the peer hung up, or sent garbage. */
+static bool read_message(int fd, int &type, string &body) {
+    string msg;
+    try {
+        if (!wire::read_message(fd, msg)) {
+            return false;
+        }
+    } catch (const std::runtime_error &e) {
+        return false;
+    }
+    type = wire::header(msg).op;
+    body = msg.substr(wire::header_size);
+    return true;
+}
+
+static int64_t wall_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool is_unix(const string &addr) {
+    return addr.compare(0, 5, "unix:") == 0;
+}
+
+static struct sockaddr_un unix_address(const string &addr) {
+    const string path = addr.substr(5);
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof sun);
+    sun.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof sun.sun_path) {
+        throw std::runtime_error("bad unix socket path in " + addr);
+    }
+    memcpy(sun.sun_path, path.c_str(), path.size());
+    return sun;
+}
+
+/** @return addr's addresses, for "[host:]port". */
+static struct addrinfo *resolve(const string &addr, bool passive) {
+    string host;
+    string port = addr;
+    const size_t colon = addr.rfind(':');
+    if (colon != string::npos) {
+        host = addr.substr(0, colon);
+        port = addr.substr(colon + 1);
+    }
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    struct addrinfo *res;
+    int err = getaddrinfo(host.empty() ? (passive ? NULL : "localhost") : host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0) {
+        throw std::runtime_error("can't resolve " + addr + ": " + gai_strerror(err));
+    }
+    return res;
+}
+
+/** @return a socket connected to addr, or -1 with errno set. */
+static int connect_to(const string &addr) {
+    if (is_unix(addr)) {
+        const struct sockaddr_un sun = unix_address(addr);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (connect(fd, (const struct sockaddr *) &sun, sizeof sun) != 0) {
+            const int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        return fd;
+    }
+    struct addrinfo *res = resolve(addr, false);
+    int fd = -1;
+    int err = 0;
+    for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            err = errno;
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            err = errno;
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd < 0) {
+        errno = err;
+        return -1;
+    }
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    return fd;
+}
+
+/** Tells the run to stop, since there's nobody left to report to. */
+static void coordinator_lost() {
+    cerr << "lost the coordinator, stopping" << endl;
+    interrupter.interrupt();
+    interrupter.check_for_interrupt();
+}
+
+DistWorker::DistWorker(const string &addr) : _fd(-1) {
+    const timestamp_t deadline = now() + secs_to_ts(30.0);
+    while ((_fd = connect_to(addr)) < 0) {
+        if ((errno != ECONNREFUSED && errno != ENOENT) || now() > deadline) {
+            throw std::runtime_error("can't connect to coordinator at " + addr + ": " + strerror(errno));
+        }
+        usleep(100000);
+    }
+}
+
+DistWorker::~DistWorker() {
+    close(_fd);
+}
+
+void DistWorker::receive(int type, string &body) {
+    while (true) {
+        interrupter.check_for_interrupt();
+        struct pollfd p = {_fd, POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) {
+            continue;
+        }
+        int got;
+        if (!read_message(_fd, got, body) || got != type) {
+            coordinator_lost();
+        }
+        return;
+    }
+}
+
+void DistWorker::send(int type, const string &body) {
+    if (!send_message(_fd, type, body)) {
+        coordinator_lost();
+    }
+}
+
+bool DistWorker::configure(Options &opts) {
+    int type;
+    string body;
+    if (!read_message(_fd, type, body) || type != msg_config) {
+        cerr << "coordinator hung up before sending options" << endl;
+        return false;
+    }
+    Unpacker u(body);
+    vector<string> args;
+    for (uint32_t n = u.get<uint32_t>(); n > 0; --n) {
+        args.push_back(u.get_string());
+    }
+    std::map<string, string> files;
+    for (uint32_t n = u.get<uint32_t>(); n > 0; --n) {
+        const string name = u.get_string();
+        files[name] = u.get_string();
+    }
+
+    vector<const char *> argv(1, "cortisol");
+    for (auto it = args.begin(); it != args.end(); ++it) {
+        argv.push_back(it->c_str());
+    }
+    Options theirs = Options::default_options();
+    if (!parse_cmdline(argv.size(), argv.data(), theirs, files)) {
+        Packer p;
+        p.put(string("couldn't parse the options"));
+        send_message(_fd, msg_error, p.buf);
+        return false;
+    }
+    theirs.create = false;
+    Dist::listen.clear();
+    Dist::spawn = false;
+    opts = theirs;
+    return send_message(_fd, msg_ready, string());
+}
+
+timestamp_t DistWorker::start() {
+    string body;
+    receive(msg_start, body);
+    const int64_t start_ns = Unpacker(body).get<int64_t>();
+    const timestamp_t t = now();
+    const int64_t wait_ns = start_ns - wall_clock_ns();
+    if (wait_ns < 0) {
+        cerr << "got the start time " << -wait_ns / 1000000 << " ms after it, starting now (are clocks in sync?)" << endl;
+        return t;
+    }
+    return t + secs_to_ts(wait_ns / 1e9);
+}
+
+void DistWorker::sleep(double secs) {
+    struct pollfd p = {_fd, POLLIN, 0};
+    // The coordinator doesn't send anything once we've started, unless it's hanging up.
+    if (poll(&p, 1, std::max(secs, 0.0) * 1000) > 0) {
+        coordinator_lost();
+    }
+}
+
+void DistWorker::send(const Report &r) {
+    Packer p;
+    p.put<uint32_t>(r.records.size());
+    for (auto it = r.records.begin(); it != r.records.end(); ++it) {
+        p.put(*it);
+    }
+    send(r.totals ? msg_totals : msg_report, p.buf);
+}
+
+Coordinator::Coordinator(int argc, const char *argv[]) : _listen_fd(-1) {
+    if (Dist::workers == 0) {
+        throw std::runtime_error("--dist.workers must be at least 1");
+    }
+    for (int i = 1; i < argc; ++i) {
+        _args.push_back(argv[i]);
+        if (argv[i][0] == '@') {
+            std::ifstream ifs(argv[i] + 1);
+            if (ifs.good()) {
+                std::stringstream ss;
+                ss << ifs.rdbuf();
+                _files[argv[i] + 1] = ss.str();
+            }
+        }
+    }
+
+    _addr = Dist::listen;
+    if (_addr.empty()) {
+        _addr = "unix:/tmp/cortisol-" + std::to_string(getpid()) + ".sock";
+    }
+    if (is_unix(_addr)) {
+        const struct sockaddr_un sun = unix_address(_addr);
+        _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(sun.sun_path);
+        if (_listen_fd < 0 || bind(_listen_fd, (const struct sockaddr *) &sun, sizeof sun) != 0) {
+            throw std::runtime_error("can't listen on " + _addr + ": " + strerror(errno));
+        }
+        _unix_path = sun.sun_path;
+    } else {
+        struct addrinfo *res = resolve(_addr, true);
+        _listen_fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        const int one = 1;
+        setsockopt(_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        const bool bound = _listen_fd >= 0 && bind(_listen_fd, res->ai_addr, res->ai_addrlen) == 0;
+        const int err = errno;
+        freeaddrinfo(res);
+        if (!bound) {
+            throw std::runtime_error("can't listen on " + _addr + ": " + strerror(err));
+        }
+        // With port 0, tell workers the port we got.
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof ss;
+        getsockname(_listen_fd, (struct sockaddr *) &ss, &len);
+        const int port = ntohs(ss.ss_family == AF_INET6 ? ((struct sockaddr_in6 *) &ss)->sin6_port : ((struct sockaddr_in *) &ss)->sin_port);
+        const size_t colon = _addr.rfind(':');
+        _addr = (colon == string::npos ? string() : _addr.substr(0, colon + 1)) + std::to_string(port);
+    }
+    if (::listen(_listen_fd, 128) != 0) {
+        throw std::runtime_error("can't listen on " + _addr + ": " + strerror(errno));
+    }
+
+    if (Dist::spawn) {
+        const string arg = "--dist.coordinator=" + _addr;
+        for (size_t i = 0; i < Dist::workers; ++i) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                throw std::runtime_error(string("can't start a worker: ") + strerror(errno));
+            }
+            if (pid == 0) {
+                execl("/proc/self/exe", argv[0], arg.c_str(), (char *) NULL);
+                perror("exec worker");
+                _exit(127);
+            }
+            _children.push_back(pid);
+        }
+    }
+}
+
+Coordinator::~Coordinator() {
+    for (auto it = _fds.begin(); it != _fds.end(); ++it) {
+        if (*it >= 0) {
+            close(*it);
+        }
+    }
+    if (_listen_fd >= 0) {
+        close(_listen_fd);
+    }
+    if (!_unix_path.empty()) {
+        unlink(_unix_path.c_str());
+    }
+    // Workers stop when we hang up, but ones still trying to connect would keep at it for a while.
+    const timestamp_t deadline = now() + secs_to_ts(5.0);
+    for (auto it = _children.begin(); it != _children.end(); ++it) {
+        while (waitpid(*it, NULL, WNOHANG) == 0) {
+            if (now() > deadline) {
+                kill(*it, SIGTERM);
+                waitpid(*it, NULL, 0);
+                break;
+            }
+            usleep(10000);
+        }
+    }
+}
+
+void Coordinator::accept_workers() {
+    cerr << "waiting for " << Dist::workers << " workers on " << _addr << endl;
+    while (_fds.size() < Dist::workers) {
+        interrupter.check_for_interrupt();
+        for (auto it = _children.begin(); it != _children.end(); ++it) {
+            if (waitpid(*it, NULL, WNOHANG) == *it) {
+                _children.erase(it);
+                throw std::runtime_error("a worker exited before it connected");
+            }
+        }
+        struct pollfd p = {_listen_fd, POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) {
+            continue;
+        }
+        int fd = accept4(_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        _fds.push_back(fd);
+    }
+}
+
+/** All workers' nth interval report, or their totals, added up runner by runner. */
+class MergedReport {
+    std::map<string, size_t> _index;  // phase, ns, type, id -> record
+
+  public:
+    shared_ptr<Report> report;
+
+    MergedReport() : report(new Report) {}
+
+    void add(const Record &r) {
+        std::stringstream key;
+        key << r.phase << '\0' << r.ns << '\0' << r.type << '\0' << r.id;
+        auto it = _index.find(key.str());
+        if (it == _index.end()) {
+            _index[key.str()] = report->records.size();
+            report->records.push_back(r);
+            return;
+        }
+        Record &m = report->records[it->second];
+        m.period = std::max(m.period, r.period);
+        m.elapsed = std::max(m.elapsed, r.elapsed);
+        m.ops += r.ops;
+        m.c_ops += r.c_ops;
+        m.bytes += r.bytes;
+        m.c_bytes += r.c_bytes;
+        m.docs += r.docs;
+        m.c_docs += r.c_docs;
+        m.errors += r.errors;
+        m.c_errors += r.c_errors;
+        m.latency += r.latency;
+        m.c_latency += r.c_latency;
+        m.late += r.late;
+        m.c_late += r.c_late;
+    }
+};
+
+void Coordinator::run(ServerStats *stats) {
+    accept_workers();
+    const size_t n = _fds.size();
+
+    Packer config;
+    config.put<uint32_t>(_args.size());
+    for (auto it = _args.begin(); it != _args.end(); ++it) {
+        config.put(*it);
+    }
+    config.put<uint32_t>(_files.size());
+    for (auto it = _files.begin(); it != _files.end(); ++it) {
+        config.put(it->first);
+        config.put(it->second);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        send_message(_fds[i], msg_config, config.buf);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        int type;
+        string body;
+        if (!read_message(_fds[i], type, body)) {
+            throw std::runtime_error("worker " + std::to_string(i) + " hung up before starting");
+        }
+        if (type == msg_error) {
+            throw std::runtime_error("worker " + std::to_string(i) + ": " + Unpacker(body).get_string());
+        }
+    }
+
+    Packer start;
+    start.put<int64_t>(wall_clock_ns() + static_cast<int64_t>(Dist::start_delay * 1e9));
+    for (size_t i = 0; i < n; ++i) {
+        send_message(_fds[i], msg_start, start.buf);
+    }
+    cerr << "starting " << n << " workers in " << Dist::start_delay << " s" << endl;
+
+    Reporter reporter;
+    std::map<size_t, MergedReport> intervals;
+    MergedReport totals;
+    totals.report->totals = true;
+    vector<size_t> received(n, 0);  // interval reports from each worker
+    vector<bool> running(n, true);  // hasn't sent its totals or hung up
+    size_t nrunning = n;
+
+    auto hang_up = [this, &running, &nrunning](size_t i) {
+        close(_fds[i]);
+        _fds[i] = -1;
+        running[i] = false;
+        --nrunning;
+    };
+    // An interval can be printed once every worker that's still running has sent its report for it.
+    auto print_complete = [&intervals, &received, &running, &reporter, n]() {
+        while (!intervals.empty()) {
+            auto it = intervals.begin();
+            for (size_t i = 0; i < n; ++i) {
+                if (running[i] && received[i] <= it->first) {
+                    return;
+                }
+            }
+            Report &r = *it->second.report;
+            r.header = ((it->first * r.records.size()) % out::header_period == 0 ||
+                        (it->first == 0 && out::header_period >= 0));
+            reporter.push(it->second.report);
+            intervals.erase(it);
+        }
+    };
+
+    while (nrunning > 0) {
+        interrupter.check_for_interrupt();
+        vector<struct pollfd> pfds;
+        vector<size_t> which;
+        for (size_t i = 0; i < n; ++i) {
+            if (running[i]) {
+                struct pollfd p = {_fds[i], POLLIN, 0};
+                pfds.push_back(p);
+                which.push_back(i);
+            }
+        }
+        if (poll(pfds.data(), pfds.size(), 100) <= 0) {
+            continue;
+        }
+        for (size_t j = 0; j < pfds.size(); ++j) {
+            if (pfds[j].revents == 0) {
+                continue;
+            }
+            const size_t i = which[j];
+            int type;
+            string body;
+            bool ok = read_message(_fds[i], type, body) && (type == msg_report || type == msg_totals);
+            vector<Record> records;
+            if (ok) {
+                try {
+                    Unpacker u(body);
+                    records.resize(u.get<uint32_t>());
+                    for (auto it = records.begin(); it != records.end(); ++it) {
+                        u.get(*it);
+                    }
+                } catch (const std::runtime_error &e) {
+                    ok = false;
+                }
+            }
+            if (!ok) {
+                cerr << "lost worker " << i << ", its results are missing from here on" << endl;
+                hang_up(i);
+                continue;
+            }
+            if (type == msg_report && stats != NULL && intervals.count(received[i]) == 0) {
+                intervals[received[i]].report->server = stats->sample(records.empty() ? string() : records.front().phase);
+            }
+            MergedReport &m = type == msg_totals ? totals : intervals[received[i]++];
+            for (auto it = records.begin(); it != records.end(); ++it) {
+                m.add(*it);
+            }
+            if (type == msg_totals) {
+                hang_up(i);
+            }
+        }
+        print_complete();
+    }
+    print_complete();
+    reporter.push(totals.report);
+    reporter.finish();
+}
+
+} // namespace cortisol
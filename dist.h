@@ -0,0 +1,114 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "options.h"
+#include "report.h"
+#include "server_stats.h"
+#include "timing.h"
+
+namespace cortisol {
+
+namespace po = boost::program_options;
+
+using std::string;
+using std::vector;
+
+/**
+ * Running one stress test from several cortisol processes, for when one
+ * load box runs out before the server does.
+ *
+ * A coordinator (--dist.listen, or --dist.spawn to start its own workers
+ * on this host) creates and fills the collections as usual, then waits
+ * for --dist.workers workers (--dist.coordinator=<its address>) to
+ * connect.  It hands each of them its own command line and the contents
+ * of its config files, so they all run the same stressors and phases, and
+ * a start time --dist.start_delay seconds out, which they all start on.
+ * Workers send their reports back instead of printing them, and the
+ * coordinator merges the nth report of every worker, adding up each
+ * runner's counters and histograms across workers, and prints that.
+ *
+ * Addresses are "unix:<path>" or "[host:]port".  Start times go over the
+ * wire as wall clock times, so workers on other hosts need synced clocks.
+ */
+class Dist {
+  public:
+    // config
+    static string listen;
+    static string coordinator;
+    static size_t workers;
+    static bool spawn;
+    static double start_delay;
+    static po::options_description options_description();
+};
+
+/** A worker's connection to its coordinator. */
+class DistWorker {
+    int _fd;
+
+    /** Waits for a message from the coordinator.  Interrupts the run if it's gone. */
+    void receive(int type, string &body);
+    void send(int type, const string &body);
+
+  public:
+    /** Connects to the coordinator at addr, retrying while it starts up.  @throws std::runtime_error if it never answers. */
+    explicit DistWorker(const string &addr);
+    ~DistWorker();
+    DistWorker(const DistWorker&) = delete;
+    DistWorker& operator=(const DistWorker&) = delete;
+
+    /**
+     * Parses the coordinator's command line and config files into opts, as
+     * if they were ours, and tells it whether that worked.  Workers never
+     * create or fill collections, the coordinator does.
+     * @return false if we should exit.
+     */
+    bool configure(Options &opts);
+
+    /** Waits for the coordinator to say when to start.  @return that time, on our clock. */
+    timestamp_t start();
+
+    /** Sleeps for secs, or until we're interrupted or the coordinator goes away. */
+    void sleep(double secs);
+
+    /** Sends an interval report or the totals to the coordinator. */
+    void send(const Report &r);
+};
+
+/** Hands out a run to the workers and merges what they report. */
+class Coordinator {
+    int _listen_fd;
+    string _addr;          // where workers connect, as they'd write it
+    string _unix_path;     // to remove at the end, if we're listening on one
+    vector<string> _args;  // our command line, for the workers
+    std::map<string, string> _files;  // config files it names, by name
+    vector<pid_t> _children;
+    vector<int> _fds;
+
+    void accept_workers();
+
+  public:
+    /** Starts listening, and with --dist.spawn, starts the workers.  @throws std::runtime_error if we can't. */
+    Coordinator(int argc, const char *argv[]);
+    /** Hangs up on the workers, which stops any still running, and waits for the ones we started. */
+    ~Coordinator();
+    Coordinator(const Coordinator&) = delete;
+    Coordinator& operator=(const Coordinator&) = delete;
+
+    /**
+     * Runs the stress test on the workers, printing their merged reports,
+     * with a sample from stats (if any) when each interval's first report
+     * comes in.  @throws std::runtime_error if a worker won't run it.
+     */
+    void run(ServerStats *stats);
+};
+
+} // namespace cortisol
@@ -0,0 +1,140 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "distribution.h"
+
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+
+namespace cortisol {
+
+using std::string;
+
+std::istream &operator>>(std::istream &is, Distribution &d) {
+    string s;
+    is >> s;
+    std::replace(s.begin(), s.end(), ':', ' ');
+    std::istringstream ss(s);
+    string kind;
+    ss >> kind;
+
+    Distribution r;
+    if (kind == "uniform") {
+        r.kind = Distribution::uniform;
+    } else if (kind == "zipfian" || kind == "latest") {
+        r.kind = kind == "zipfian" ? Distribution::zipfian : Distribution::latest;
+        if (!(ss >> r.theta)) {
+            r.theta = Distribution().theta;
+        }
+        if (r.theta <= 0 || r.theta >= 1) {
+            is.setstate(std::ios_base::failbit);
+            return is;
+        }
+    } else if (kind == "hotspot") {
+        r.kind = Distribution::hotspot;
+        if (ss >> r.hot_ops) {
+            if (!(ss >> r.hot_keys)) {
+                is.setstate(std::ios_base::failbit);
+                return is;
+            }
+        } else {
+            r.hot_ops = Distribution().hot_ops;
+        }
+        if (r.hot_ops < 0 || r.hot_ops > 1 || r.hot_keys < 0 || r.hot_keys > 1) {
+            is.setstate(std::ios_base::failbit);
+            return is;
+        }
+    } else if (kind == "constant") {
+        r.kind = Distribution::constant;
+    } else {
+        is.setstate(std::ios_base::failbit);
+        return is;
+    }
+    d = r;
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const Distribution &d) {
+    switch (d.kind) {
+        case Distribution::zipfian:
+            return os << "zipfian:" << d.theta;
+        case Distribution::latest:
+            return os << "latest:" << d.theta;
+        case Distribution::hotspot:
+            return os << "hotspot:" << d.hot_ops << ":" << d.hot_keys;
+        case Distribution::constant:
+            return os << "constant";
+        case Distribution::uniform:
+        default:
+            return os << "uniform";
+    }
+}
+
+/**
+ * @return sum(1/i^theta) for i in [1, n].  The first million terms are
+ * summed exactly, and the tail is replaced by its integral, which is
+ * accurate to many digits by then and keeps setup fast for huge n.
+ */
+static double compute_zeta(uint64_t n, double theta) {
+    static const uint64_t exact_terms = 1 << 20;
+    const uint64_t m = std::min(n, exact_terms);
+    double sum = 0;
+    for (uint64_t i = 1; i <= m; ++i) {
+        sum += 1.0 / pow(i, theta);
+    }
+    if (n > m) {
+        sum += (pow(n + 0.5, 1 - theta) - pow(m + 0.5, 1 - theta)) / (1 - theta);
+    }
+    return sum;
+}
+
+/**
+ * compute_zeta(), remembered for each (n, theta), since every runner
+ * thread's key generators tend to ask for the same ones.  Thread safe.
+ */
+static double zeta(uint64_t n, double theta) {
+    static std::mutex mutex;
+    static std::map<std::pair<uint64_t, double>, double> cache;
+    std::lock_guard<std::mutex> lk(mutex);
+    const std::pair<uint64_t, double> key(n, theta);
+    auto it = cache.find(key);
+    if (it == cache.end()) {
+        it = cache.insert(std::make_pair(key, compute_zeta(n, theta))).first;
+    }
+    return it->second;
+}
+
+key_generator::key_generator(const Distribution &d, uint64_t n)
+        : _d(d), _n(std::max<uint64_t>(n, 1)), _zetan(0), _alpha(0), _eta(0), _half_pow_theta(0), _hot(0) {
+    if (_d.kind == Distribution::zipfian || _d.kind == Distribution::latest) {
+        // Gray et al., "Quickly Generating Billion-Record Synthetic Databases", as in YCSB.
+        const double theta = _d.theta;
+        const double zeta2 = zeta(2, theta);
+        _zetan = zeta(_n, theta);
+        _alpha = 1.0 / (1.0 - theta);
+        _eta = (1 - pow(2.0 / _n, 1 - theta)) / (1 - zeta2 / _zetan);
+        _half_pow_theta = 1 + pow(0.5, theta);
+    } else if (_d.kind == Distribution::hotspot) {
+        _hot = _n * _d.hot_keys;
+    }
+}
+
+uint64_t key_generator::zipf(rng &r) const {
+    const double u = r.real();
+    const double uz = u * _zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < _half_pow_theta) {
+        return std::min<uint64_t>(1, _n - 1);
+    }
+    return std::min<uint64_t>(_n * pow(_eta * u - _eta + 1, _alpha), _n - 1);
+}
+
+} // namespace cortisol
@@ -0,0 +1,81 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <iostream>
+
+#include "rng.h"
+
+namespace cortisol {
+
+/**
+ * Which keys a stressor picks, as given on the command line:
+ *
+ *   uniform                 every key equally likely
+ *   zipfian[:theta]         key k has weight 1/(k+1)^theta, 0 < theta < 1 (default 0.99)
+ *   latest[:theta]          zipfian, but counting down from the largest key
+ *   hotspot[:ops:keys]      a fraction ops of requests go to the first fraction keys
+ *                           of the key space (default 0.9:0.1)
+ *   constant                always the largest key, n - 1
+ */
+class Distribution {
+  public:
+    enum kind_t { uniform, zipfian, latest, hotspot, constant };
+
+    kind_t kind;
+    double theta;
+    double hot_ops;
+    double hot_keys;
+
+    Distribution() : kind(uniform), theta(0.99), hot_ops(0.9), hot_keys(0.1) {}
+    explicit Distribution(kind_t k) : kind(k), theta(0.99), hot_ops(0.9), hot_keys(0.1) {}
+};
+
+std::istream &operator>>(std::istream &is, Distribution &d);
+std::ostream &operator<<(std::ostream &os, const Distribution &d);
+
+/** Draws keys in [0, n) from a Distribution.  Cheap to call; construction does the setup. */
+class key_generator {
+    Distribution _d;
+    uint64_t _n;
+
+    // zipfian/latest
+    double _zetan;
+    double _alpha;
+    double _eta;
+    double _half_pow_theta;
+
+    // hotspot
+    uint64_t _hot;
+
+    uint64_t zipf(rng &r) const;
+
+  public:
+    key_generator(const Distribution &d, uint64_t n);
+
+    uint64_t operator()(rng &r) const {
+        switch (_d.kind) {
+            case Distribution::zipfian:
+                return zipf(r);
+            case Distribution::latest:
+                return _n - 1 - zipf(r);
+            case Distribution::hotspot:
+                if (_hot == 0 || _hot >= _n) {
+                    return r.uniform(_n);
+                }
+                if (r.real() < _d.hot_ops) {
+                    return r.uniform(_hot);
+                }
+                return _hot + r.uniform(_n - _hot);
+            case Distribution::constant:
+                return _n - 1;
+            case Distribution::uniform:
+            default:
+                return r.uniform(_n);
+        }
+    }
+};
+
+} // namespace cortisol
@@ -0,0 +1,430 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+/**
+ * cortisol-fakemongod: a stand-in server for end-to-end tests of cortisol.
+ *
+ * Speaks enough of the wire protocol (OP_QUERY, OP_GET_MORE, OP_INSERT,
+ * OP_UPDATE, OP_DELETE, OP_KILL_CURSORS and the handful of commands the
+ * driver and cortisol send) to serve cortisol from MockStores, one thread
+ * per connection.  Every reply can be delayed by a fixed latency, and all
+ * replies can be held during periodic stalls, so the latency cortisol
+ * reports can be checked against what was injected.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "mongo/client/dbclient.h"
+
+#include "mock_store.h"
+#include "timing.h"
+#include "wire.h"
+
+namespace cortisol {
+
+namespace po = boost::program_options;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using mongo::BSONObj;
+using mongo::BSONObjBuilder;
+
+static string bind_ip = "127.0.0.1";
+static int port = 27017;
+static size_t keyspace = 1048576;
+static double stall_every = 0;
+static double stall_for = 0;
+
+static timestamp_t start;
+static std::atomic<int32_t> next_request_id(1);
+
+/** Counted like serverStatus's opcounters. */
+static std::atomic<uint64_t> n_insert(0), n_query(0), n_update(0), n_delete(0), n_getmore(0), n_command(0);
+/** Counted like serverStatus's network section. */
+static std::atomic<uint64_t> bytes_in(0), bytes_out(0), n_requests(0);
+
+/** Holds a reply until any stall in progress is over, then adds the usual latency. */
+static void delay() {
+    if (stall_every > 0 && stall_for > 0) {
+        const double into = fmod(ts_to_secs(now() - start), stall_every);
+        if (into < stall_for) {
+            usleep((stall_for - into) * 1000000);
+        }
+    }
+    MockStore::delay();
+}
+
+static bool ends_with(const string &s, const string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/** One client connection. */
+class Session {
+    class Cursor {
+      public:
+        vector<BSONObj> docs;
+        size_t pos;
+    };
+
+    const int _fd;
+    uint64_t _last_n;
+    string _last_err;
+    std::map<int64_t, Cursor> _cursors;
+    int64_t _next_cursor;
+
+    MockStore &store(const string &ns) {
+        return MockStore::get(ns, keyspace);
+    }
+
+    /** Sends docs[begin, end).  @return the reply's request id. */
+    int32_t reply(int32_t response_to, int32_t flags, int64_t cursor_id, size_t begin, size_t end, const vector<BSONObj> &docs) {
+        const int32_t id = next_request_id++;
+        wire::Builder b(wire::op_reply, id, response_to);
+        b.int32(flags);
+        b.int64(cursor_id);
+        b.int32(begin);
+        b.int32(end - begin);
+        for (size_t i = begin; i < end; ++i) {
+            b.doc(docs[i]);
+        }
+        const string &msg = b.finish();
+        delay();
+        bytes_out += msg.size();
+        if (!wire::write_all(_fd, msg.data(), msg.size())) {
+            throw std::runtime_error("connection closed");
+        }
+        return id;
+    }
+
+    int32_t reply(int32_t response_to, int32_t flags, const BSONObj &doc) {
+        vector<BSONObj> docs(1, doc);
+        return reply(response_to, flags, 0, 0, 1, docs);
+    }
+
+    /** @return the end of the next batch of c, of n documents (0 for the server's choice), and at most 4MB. */
+    static size_t batch_end(const Cursor &c, int32_t n, bool first) {
+        size_t limit = n != 0 ? abs(n) : (first ? 101 : c.docs.size());
+        size_t end = c.pos;
+        size_t bytes = 0;
+        while (end < c.docs.size() && end - c.pos < limit && bytes < (4 << 20)) {
+            bytes += c.docs[end++].objsize();
+        }
+        return end;
+    }
+
+    void command(int32_t request_id, const string &db, const BSONObj &cmd) {
+        ++n_command;
+        string name = cmd.firstElementFieldName();
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+        BSONObjBuilder b;
+        if (name == "getlasterror") {
+            b.append("n", (long long) _last_n);
+            if (_last_err.empty()) {
+                b.appendNull("err");
+            } else {
+                b.append("err", _last_err);
+            }
+        } else if (name == "ismaster") {
+            b.append("ismaster", true);
+            b.append("maxBsonObjectSize", 16 << 20);
+            b.append("maxMessageSizeBytes", wire::max_message_size);
+        } else if (name == "buildinfo") {
+            b.append("version", "2.4.0");
+            b.append("fakemongod", true);
+        } else if (name == "drop") {
+            store(db + "." + cmd.firstElement().str()).drop();
+        } else if (name == "serverstatus") {
+            BSONObjBuilder ob(b.subobjStart("opcounters"));
+            ob.append("insert", (long long) n_insert);
+            ob.append("query", (long long) n_query);
+            ob.append("update", (long long) n_update);
+            ob.append("delete", (long long) n_delete);
+            ob.append("getmore", (long long) n_getmore);
+            ob.append("command", (long long) n_command);
+            ob.doneFast();
+            BSONObjBuilder nb(b.subobjStart("network"));
+            nb.append("bytesIn", (long long) bytes_in);
+            nb.append("bytesOut", (long long) bytes_out);
+            nb.append("numRequests", (long long) n_requests);
+            nb.doneFast();
+            b.append("uptime", ts_to_secs(now() - start));
+        } else if (name == "ping" || name == "create" || name == "getnonce" || name == "whatsmyuri") {
+            // ok
+        } else {
+            b.append("errmsg", "no such cmd: " + name);
+            b.append("ok", 0.0);
+            reply(request_id, 0, b.obj());
+            return;
+        }
+        b.append("ok", 1.0);
+        reply(request_id, 0, b.obj());
+    }
+
+    void query(const wire::Header &h, wire::Reader &r) {
+        const int32_t flags = r.int32();
+        const string ns = r.cstring();
+        const int32_t skip = r.int32();
+        const int32_t ntoreturn = r.int32();
+        const BSONObj q = r.doc();
+        BSONObj fields;
+        if (r.more()) {
+            fields = r.doc();
+        }
+
+        if (ends_with(ns, ".$cmd")) {
+            command(h.request_id, ns.substr(0, ns.size() - 5), q);
+            return;
+        }
+        ++n_query;
+
+        // ntoreturn < 0 or == 1 asks for a single batch, anything else is a batch size.
+        const bool single = ntoreturn < 0 || ntoreturn == 1;
+        // A single batch is a limit, so don't collect more than it'll send.
+        const int limit = single ? std::max(skip, 0) + std::max(abs(ntoreturn), 1) : 0;
+
+        Cursor c;
+        c.pos = 0;
+        if (!ends_with(ns, ".system.indexes")) {
+            try {
+                store(ns).query(q, fields.isEmpty() ? NULL : &fields, limit, [&c](const BSONObj &o) { c.docs.push_back(o); });
+            } catch (std::exception &e) {
+                reply(h.request_id, wire::reply_query_failure, BSON("$err" << e.what()));
+                return;
+            }
+        }
+        c.docs.erase(c.docs.begin(), c.docs.begin() + std::min<size_t>(std::max(skip, 0), c.docs.size()));
+
+        int32_t response_to = h.request_id;
+        bool first = true;
+        do {
+            size_t end = batch_end(c, ntoreturn, first);
+            const bool done = single || end == c.docs.size();
+            const int64_t id = done ? 0 : _next_cursor;
+            response_to = reply(response_to, 0, id, c.pos, end, c.docs);
+            c.pos = end;
+            first = false;
+            if (done) {
+                return;
+            }
+        } while (flags & wire::query_exhaust);  // exhaust: keep streaming, each reply answering the last
+        _cursors[_next_cursor++] = c;
+    }
+
+    void get_more(const wire::Header &h, wire::Reader &r) {
+        ++n_getmore;
+        r.int32();
+        r.cstring();
+        const int32_t n = r.int32();
+        const int64_t id = r.int64();
+        auto it = _cursors.find(id);
+        if (it == _cursors.end()) {
+            vector<BSONObj> none;
+            reply(h.request_id, wire::reply_cursor_not_found, 0, 0, 0, none);
+            return;
+        }
+        Cursor &c = it->second;
+        const size_t begin = c.pos;
+        const size_t end = batch_end(c, n, false);
+        c.pos = end;
+        const bool done = end == c.docs.size();
+        reply(h.request_id, 0, done ? 0 : id, begin, end, c.docs);
+        if (done) {
+            _cursors.erase(it);
+        }
+    }
+
+    void insert(wire::Reader &r) {
+        ++n_insert;
+        r.int32();
+        const string ns = r.cstring();
+        vector<BSONObj> docs;
+        while (r.more()) {
+            docs.push_back(r.doc());
+        }
+        _last_n = 0;
+        _last_err.clear();
+        if (!ends_with(ns, ".system.indexes")) {
+            store(ns).insert(docs);
+        }
+    }
+
+    void update(wire::Reader &r) {
+        ++n_update;
+        r.int32();
+        const string ns = r.cstring();
+        r.int32();  // upsert and multi aren't supported
+        const BSONObj selector = r.doc();
+        const BSONObj update = r.doc();
+        _last_err.clear();
+        try {
+            _last_n = store(ns).update(selector, update);
+        } catch (std::exception &e) {
+            _last_n = 0;
+            _last_err = e.what();
+        }
+    }
+
+    void remove(wire::Reader &r) {
+        ++n_delete;
+        r.int32();
+        const string ns = r.cstring();
+        const int32_t flags = r.int32();
+        const BSONObj selector = r.doc();
+        _last_err.clear();
+        try {
+            _last_n = store(ns).remove(selector, flags & wire::delete_single);
+        } catch (std::exception &e) {
+            _last_n = 0;
+            _last_err = e.what();
+        }
+    }
+
+    void kill_cursors(wire::Reader &r) {
+        r.int32();
+        const int32_t n = r.int32();
+        for (int32_t i = 0; i < n; ++i) {
+            _cursors.erase(r.int64());
+        }
+    }
+
+  public:
+    explicit Session(int fd) : _fd(fd), _last_n(0), _next_cursor(1) {}
+
+    void run() {
+        string msg;
+        while (wire::read_message(_fd, msg)) {
+            bytes_in += msg.size();
+            ++n_requests;
+            const wire::Header &h = wire::header(msg);
+            wire::Reader r = wire::body(msg);
+            switch (h.op) {
+                case wire::op_query:
+                    query(h, r);
+                    break;
+                case wire::op_get_more:
+                    get_more(h, r);
+                    break;
+                case wire::op_insert:
+                    insert(r);
+                    break;
+                case wire::op_update:
+                    update(r);
+                    break;
+                case wire::op_delete:
+                    remove(r);
+                    break;
+                case wire::op_kill_cursors:
+                    kill_cursors(r);
+                    break;
+                default:
+                    throw std::runtime_error("unsupported opcode");
+            }
+        }
+    }
+};
+
+static void serve(int fd) {
+    try {
+        Session(fd).run();
+    } catch (std::exception &e) {
+        cerr << "connection " << fd << ": " << e.what() << endl;
+    }
+    close(fd);
+}
+
+static po::options_description options_description() {
+    po::options_description desc("cortisol-fakemongod");
+    desc.add_options()
+            ("help,h", "Get help.")
+            ("bind_ip",     po::value(&bind_ip)->default_value(bind_ip),         "Address to listen on.")
+            ("port",        po::value(&port)->default_value(port),               "Port to listen on.")
+            ("keyspace",    po::value(&keyspace)->default_value(keyspace),       "Range of a to split each collection's shards over (cortisol's --documents).")
+            ("stall_every", po::value(&stall_every)->default_value(stall_every), "Hold all replies for --stall_for at the start of every this many seconds (0 = never).")
+            ("stall_for",   po::value(&stall_for)->default_value(stall_for),     "Length of each stall (seconds).")
+            ;
+    desc.add(MockStore::options_description());
+    return desc;
+}
+
+static int run(int argc, const char *argv[]) {
+    po::options_description desc = options_description();
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        if (vm.count("help")) {
+            cout << desc << endl;
+            return EX_USAGE;
+        }
+        po::notify(vm);
+    } catch (po::error &e) {
+        cerr << "Error parsing command line: " << e.what() << endl << endl
+             << desc << endl;
+        return EX_USAGE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    timing_init();
+    start = now();
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, bind_ip.c_str(), &addr.sin_addr) != 1) {
+        cerr << "bad --bind_ip " << bind_ip << endl;
+        return EX_USAGE;
+    }
+    if (bind(s, (struct sockaddr *) &addr, sizeof addr) != 0 || listen(s, 128) != 0) {
+        perror("listen");
+        return EX_OSERR;
+    }
+    cerr << "listening on " << bind_ip << ":" << port << endl;
+
+    while (true) {
+        int fd = accept(s, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            return EX_OSERR;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        std::thread(serve, fd).detach();
+    }
+}
+
+} // namespace cortisol
+
+int main(int argc, const char *argv[]) {
+    return cortisol::run(argc, argv);
+}
@@ -0,0 +1,221 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iomanip>
+#include <vector>
+
+#include "output.h"
+#include "timing.h"
+
+namespace cortisol {
+
+using std::atomic;
+using std::vector;
+
+/**
+ * Log-bucketed latency histogram, in the style of HdrHistogram.
+ *
+ * Values are timestamp_t deltas.  Each power of two gets 2^sub_bits linear
+ * sub-buckets, so a reported percentile is within 1/2^sub_bits of the true
+ * value.  The bucket array is fixed size, so record() never allocates.
+ *
+ * Only one thread may record() into a histogram, so the buckets are bumped
+ * with plain relaxed loads and stores instead of locked increments.  Any
+ * thread may snap() it concurrently.
+ */
+class histogram {
+  public:
+    static const int sub_bits = 5;
+    static const size_t sub_count = size_t(1) << sub_bits;
+    static const size_t nbuckets = (64 - sub_bits + 1) * sub_count;
+
+    static size_t bucket(uint64_t v) {
+        if (v < sub_count) {
+            return v;
+        }
+        const int shift = (63 - __builtin_clzll(v)) - sub_bits;
+        return ((shift + 1) << sub_bits) + ((v >> shift) & (sub_count - 1));
+    }
+
+    /** @return the largest value that lands in bucket idx. */
+    static uint64_t bucket_max(size_t idx) {
+        if (idx < sub_count) {
+            return idx;
+        }
+        const int shift = (idx >> sub_bits) - 1;
+        const uint64_t lo = (sub_count + (idx & (sub_count - 1))) << shift;
+        return lo + ((uint64_t(1) << shift) - 1);
+    }
+
+    class snapshot {
+        vector<uint64_t> _counts;
+        uint64_t _total;
+      public:
+        snapshot() : _counts(nbuckets, 0), _total(0) {}
+
+        uint64_t count() const {
+            return _total;
+        }
+
+        /** @return the value at quantile q (0 < q <= 1), rounded up to its bucket's max. */
+        timestamp_t quantile(double q) const {
+            if (_total == 0) {
+                return 0;
+            }
+            uint64_t rank = std::max<uint64_t>(1, q * _total + 0.5);
+            uint64_t seen = 0;
+            for (size_t i = 0; i < nbuckets; ++i) {
+                seen += _counts[i];
+                if (seen >= rank) {
+                    return bucket_max(i);
+                }
+            }
+            return max();
+        }
+
+        timestamp_t max() const {
+            for (size_t i = nbuckets; i > 0; --i) {
+                if (_counts[i - 1] != 0) {
+                    return bucket_max(i - 1);
+                }
+            }
+            return 0;
+        }
+
+        /** @return how many values landed in bucket i, for shipping a snapshot to another process. */
+        uint64_t bucket_count(size_t i) const {
+            return _counts[i];
+        }
+
+        /** Adds n values to bucket i, for rebuilding a snapshot shipped from another process. */
+        void add_bucket(size_t i, uint64_t n) {
+            _counts[i] += n;
+            _total += n;
+        }
+
+        snapshot &operator+=(const snapshot &o) {
+            for (size_t i = 0; i < nbuckets; ++i) {
+                _counts[i] += o._counts[i];
+            }
+            _total += o._total;
+            return *this;
+        }
+
+        snapshot &operator-=(const snapshot &o) {
+            for (size_t i = 0; i < nbuckets; ++i) {
+                _counts[i] -= o._counts[i];
+            }
+            _total -= o._total;
+            return *this;
+        }
+
+        friend class histogram;
+    };
+
+  private:
+    atomic<uint64_t> _counts[nbuckets];
+
+  public:
+    histogram() {
+        for (size_t i = 0; i < nbuckets; ++i) {
+            _counts[i].store(0, std::memory_order_relaxed);
+        }
+    }
+    histogram(const histogram&) = delete;
+    histogram& operator=(const histogram&) = delete;
+
+    void record(timestamp_t v, uint64_t n = 1) {
+        atomic<uint64_t> &c = _counts[bucket(v)];
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    snapshot snap() const {
+        snapshot s;
+        for (size_t i = 0; i < nbuckets; ++i) {
+            s._counts[i] = _counts[i].load(std::memory_order_relaxed);
+            s._total += s._counts[i];
+        }
+        return s;
+    }
+
+    class output_line {
+        bool _total;
+        snapshot _iteration;
+        snapshot _cumulative;
+
+        static double usecs(timestamp_t t) {
+            return ts_to_secs(t) * 1000000.0;
+        }
+
+        template<typename ostream_type>
+        static void quantiles(ostream_type &os, const snapshot &s) {
+            using out::ofs;
+            os << fmt() << usecs(s.quantile(0.50)) << ofs
+               << fmt() << usecs(s.quantile(0.90)) << ofs
+               << fmt() << usecs(s.quantile(0.99)) << ofs
+               << fmt() << usecs(s.quantile(0.999)) << ofs
+               << fmt() << usecs(s.max());
+        }
+
+      public:
+        output_line(const snapshot &iteration, const snapshot &cumulative) : _total(false), _iteration(iteration), _cumulative(cumulative) {}
+        output_line(const snapshot &cumulative) : _total(true), _cumulative(cumulative) {}
+
+        class fmt {
+          public:
+            template<typename ostream_type>
+            friend inline ostream_type &operator<<(ostream_type &os, const fmt &h) {
+                os << out::pad(12) << std::fixed << std::setprecision(1);
+                return os;
+            }
+        };
+
+        template<typename ostream_type>
+        friend inline ostream_type &operator<<(ostream_type &os, const output_line &line) {
+            using out::ofs;
+
+            if (line._total) {
+                for (int i = 0; i < 5; ++i) {
+                    os << fmt() << "       " << ofs;
+                }
+            } else {
+                quantiles(os, line._iteration);
+                os << ofs;
+            }
+            quantiles(os, line._cumulative);
+
+            return os;
+        }
+
+        class header {
+          public:
+            template<typename ostream_type>
+            friend inline ostream_type &operator<<(ostream_type &os, const header &h) {
+                using out::ofs;
+
+                os << fmt() << "i_p50 (us)" << ofs
+                   << fmt() << "i_p90 (us)" << ofs
+                   << fmt() << "i_p99 (us)" << ofs
+                   << fmt() << "i_p999 (us)" << ofs
+                   << fmt() << "i_max (us)" << ofs
+                   << fmt() << "c_p50 (us)" << ofs
+                   << fmt() << "c_p90 (us)" << ofs
+                   << fmt() << "c_p99 (us)" << ofs
+                   << fmt() << "c_p999 (us)" << ofs
+                   << fmt() << "c_max (us)";
+                return os;
+            }
+        };
+    };
+
+    static output_line::header header() {
+        return output_line::header();
+    }
+};
+
+} // namespace cortisol
@@ -15,10 +15,17 @@
 
 #include "mongo/client/dbclient.h"
 
+#include "async.h"
 #include "collection.h"
 #include "cortisol.h"
+#include "dist.h"
 #include "options.h"
 #include "output.h"
+#include "placement.h"
+#include "report.h"
+#include "schema.h"
+#include "server_stats.h"
+#include "slow_ops.h"
 #include "thread.h"
 #include "timing.h"
 
@@ -29,6 +36,7 @@ namespace cortisol {
 
 using std::cout;
 using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -45,7 +53,31 @@ static string collname(size_t i) {
     return ss.str();
 }
 
-void run(const Options &opts) {
+/** @return a sampler for the server we're stressing, or nothing if --server_stats is off or there's no server. */
+static unique_ptr<ServerStats> server_stats(const Options &opts) {
+    if (!ServerStats::wanted(opts)) {
+        return unique_ptr<ServerStats>();
+    }
+    vector<string> namespaces;
+    for (size_t i = 0; i < Collection::collections; ++i) {
+        namespaces.push_back(collname(i));
+    }
+    return unique_ptr<ServerStats>(new ServerStats(opts, namespaces));
+}
+
+/** @return the configured phases, or if there are none, one phase that runs the usual stressors for --seconds. */
+static vector<Phase> phases(const Options &opts) {
+    if (!opts.phases.empty()) {
+        return opts.phases;
+    }
+    Phase p;
+    p.id = p.name = "main";
+    p.seconds = opts.seconds;
+    return vector<Phase>(1, p);
+}
+
+/** Runs the test, or with a coordinator, fills and hands the stress part to its workers, or as a worker, stresses for one. */
+void run(const Options &opts, Coordinator *coordinator, DistWorker *worker) {
     interrupter.check_for_interrupt();
     {
         vector<Collection> colls;
@@ -69,66 +101,150 @@ void run(const Options &opts) {
         }
     }
     interrupter.check_for_interrupt();
-    if (opts.stress) {
-        timestamp_t t0 = now();
+    if (opts.stress && coordinator != NULL) {
+        unique_ptr<ServerStats> stats = server_stats(opts);
+        coordinator->run(stats.get());
+    } else if (opts.stress) {
+        timestamp_t t0 = worker != NULL ? worker->start() : now();
         {
+            // Make enough runners of each type for the busiest phase, and
+            // park the ones a phase doesn't need.
+            const vector<RunnerType> &types = runner_types();
+            const vector<Phase> run_phases = phases(opts);
             vector<unique_ptr<CollectionRunner> > runners;
+            vector<const RunnerType *> kinds;
             for (size_t i = 0; i < Collection::collections; ++i) {
                 string coll = collname(i);
-                size_t id = 0;
-                std::generate_n(std::back_inserter(runners), UpdateRunner::threads,
-                                [opts, coll, &id, t0]() -> unique_ptr<CollectionRunner> {
-                                    return unique_ptr<CollectionRunner>(new UpdateRunner(opts, coll, id++, t0));
-                                });
-                id = 0;
-                std::generate_n(std::back_inserter(runners), PointQueryRunner::threads,
-                                [opts, coll, &id, t0]() -> unique_ptr<CollectionRunner> {
-                                    return unique_ptr<CollectionRunner>(new PointQueryRunner(opts, coll, id++, t0));
-                                });
-                id = 0;
-                std::generate_n(std::back_inserter(runners), RangeQueryRunner::threads,
-                                [opts, coll, &id, t0]() -> unique_ptr<CollectionRunner> {
-                                    return unique_ptr<CollectionRunner>(new RangeQueryRunner(opts, coll, id++, t0));
-                                });
+                for (auto type = types.begin(); type != types.end(); ++type) {
+                    size_t n = 0;
+                    for (auto phase = run_phases.begin(); phase != run_phases.end(); ++phase) {
+                        n = std::max(n, type->phase_threads(*phase));
+                    }
+                    for (size_t id = 0; id < n; ++id) {
+                        // Build each runner's stats and buffers on the node of the thread that will drive it.
+                        const size_t slot = opts.engine == Engine::async ? AsyncEngine::worker_of(runners.size()) : runners.size();
+                        Placement::scoped_node on_node(Placement::get(), slot);
+                        runners.push_back(unique_ptr<CollectionRunner>(type->make(opts, coll, id, t0)));
+                        kinds.push_back(&*type);
+                    }
+                }
+            }
+
+            auto start_phase = [&runners, &kinds](const Phase &phase) {
+                timestamp_t ti = now();
+                for (size_t r = 0; r < runners.size(); ++r) {
+                    CollectionRunner &runner = *runners[r];
+                    const size_t n = kinds[r]->phase_threads(phase);
+                    const bool active = runner.id() < n;
+                    if (active && !runner.active()) {
+                        runner.mark(ti);
+                    }
+                    runner.configure(active, kinds[r]->phase_rate(phase), n);
+                }
+            };
+            auto stop_runners = [&runners]() {
+                std::for_each(runners.begin(), runners.end(), [](const unique_ptr<CollectionRunner> &runner) { runner->stop(); });
+            };
+
+            if (worker != NULL && t0 > now()) {
+                // Wait for the others.
+                worker->sleep(ts_to_secs(t0 - now()));
+                interrupter.check_for_interrupt();
+            }
+            start_phase(run_phases.front());
+            vector<const op_watch *> watches;
+            for (auto it = runners.begin(); it != runners.end(); ++it) {
+                watches.push_back(&(*it)->watch());
             }
+            SlowOpWatchdog watchdog(watches);
+            // Workers leave the server to their coordinator.
+            unique_ptr<ServerStats> stats = worker == NULL ? server_stats(opts) : unique_ptr<ServerStats>();
+            Reporter reporter;
             vector<std::thread> threads;
-            std::transform(runners.begin(), runners.end(), std::back_inserter(threads),
-                           [](const unique_ptr<CollectionRunner> &runner) {
-                               return std::move(std::thread(std::ref(*runner)));
-                           });
+            unique_ptr<AsyncEngine> engine;
+            if (opts.engine == Engine::async) {
+                vector<CollectionRunner *> rs;
+                for (auto it = runners.begin(); it != runners.end(); ++it) {
+                    rs.push_back(it->get());
+                }
+                engine.reset(new AsyncEngine(opts, rs));
+            } else {
+                for (size_t r = 0; r < runners.size(); ++r) {
+                    CollectionRunner *runner = runners[r].get();
+                    threads.push_back(std::thread([runner, r]() {
+                                Placement::get().enter(r);
+                                (*runner)();
+                            }));
+                }
+            }
+            auto join_runners = [&threads, &engine]() {
+                std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+                if (engine) {
+                    engine->join();
+                }
+            };
 
             try {
-                double elapsed = 0.0;
-                for (int i = 0; ; interrupter.check_for_interrupt(), ++i) {
-                    usleep(std::min((opts.seconds - elapsed), out::output_period) * 1000000);
-                    timestamp_t ti = now();
-                    elapsed = ts_to_secs(ti - t0);
-                    if (elapsed >= opts.seconds) {
-                        break;
+                int i = 0;
+                for (auto phase = run_phases.begin(); phase != run_phases.end(); ++phase) {
+                    if (phase != run_phases.begin()) {
+                        start_phase(*phase);
                     }
-                    if ((i * threads.size()) % out::header_period == 0 ||
-                        (i == 0 && out::header_period >= 0)) {
-                        CollectionRunner::header(cout);
+                    timestamp_t phase_t0 = now();
+                    double elapsed = 0.0;
+                    // The last interval may be short, but it's reported under this
+                    // phase all the same, before the next phase's runners start.
+                    for (bool done = false; !done; interrupter.check_for_interrupt(), ++i) {
+                        const double secs = std::min((phase->seconds - elapsed), out::output_period);
+                        if (worker != NULL) {
+                            worker->sleep(secs);
+                        } else {
+                            usleep(secs * 1000000);
+                        }
+                        timestamp_t ti = now();
+                        elapsed = ts_to_secs(ti - phase_t0);
+                        done = elapsed >= phase->seconds;
+                        shared_ptr<Report> report(new Report);
+                        if (stats) {
+                            report->server = stats->sample(phase->name);
+                        }
+                        report->header = ((i * runners.size()) % out::header_period == 0 ||
+                                          (i == 0 && out::header_period >= 0));
+                        std::for_each(runners.begin(), runners.end(),
+                                      [ti, phase, &report](const unique_ptr<CollectionRunner> &runner) {
+                                          if (runner->active()) {
+                                              runner->report(phase->name, ti, report->records);
+                                          }
+                                      });
+                        if (worker != NULL) {
+                            worker->send(*report);
+                        } else {
+                            reporter.push(report);
+                        }
                     }
-                    std::for_each(runners.begin(), runners.end(),
-                                  [ti](const unique_ptr<CollectionRunner> &runner) {
-                                      runner->report(cout, ti);
-                                  });
                 }
             } catch (interrupt_exception) {
-                std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+                stop_runners();
+                join_runners();
                 throw;
             }
-                
-            std::for_each(runners.begin(), runners.end(), [](const unique_ptr<CollectionRunner> &runner) { runner->stop(); });
-            std::for_each(threads.begin(), threads.end(), std::mem_fn(&std::thread::join));
+
+            stop_runners();
+            join_runners();
 
             timestamp_t t1 = now();
-            cout << endl << "# TOTALS:" << endl;
+            shared_ptr<Report> totals(new Report);
+            totals->totals = true;
             std::for_each(runners.begin(), runners.end(),
-                          [t1](const unique_ptr<CollectionRunner> &runner) {
-                              runner->total(cout, t1);
+                          [t1, &totals](const unique_ptr<CollectionRunner> &runner) {
+                              runner->total(t1, totals->records);
                           });
+            if (worker != NULL) {
+                worker->send(*totals);
+            } else {
+                reporter.push(totals);
+            }
+            reporter.finish();
         }
     }
 }
@@ -137,20 +253,42 @@ void run(const Options &opts) {
 
 
 int main(int argc, const char *argv[]) {
+    // Calibrate the clock now, rather than in the middle of the first timed op.
+    timing_init();
     cortisol::Options opts = cortisol::Options::default_options();
     bool ok = cortisol::parse_cmdline(argc, argv, opts);
     if (!ok) {
         return EX_USAGE;
     }
+    std::unique_ptr<cortisol::Coordinator> coordinator;
+    std::unique_ptr<cortisol::DistWorker> worker;
+    try {
+        if (!cortisol::Dist::coordinator.empty()) {
+            worker.reset(new cortisol::DistWorker(cortisol::Dist::coordinator));
+            if (!worker->configure(opts)) {
+                return EX_USAGE;
+            }
+        } else if (!cortisol::Dist::listen.empty() || cortisol::Dist::spawn) {
+            coordinator.reset(new cortisol::Coordinator(argc, argv));
+        }
+    } catch (const std::runtime_error &e) {
+        cerr << "error: " << e.what() << endl;
+        return EXIT_FAILURE;
+    }
+    cortisol::Schema::init();
 
     signal(SIGINT, cortisol::int_handler);
     try {
-        cortisol::run(opts);
+        cortisol::Placement::init();
+        cortisol::run(opts, coordinator.get(), worker.get());
     } catch (cortisol::interrupt_exception) {
         // ok
     } catch (const mongo::DBException &e) {
         cerr << "caught " << e.what() << endl;
         return EXIT_FAILURE;
+    } catch (const std::runtime_error &e) {
+        cerr << "error: " << e.what() << endl;
+        return EXIT_FAILURE;
     }
     return EXIT_SUCCESS;
 }
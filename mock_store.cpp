@@ -0,0 +1,346 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "mock_store.h"
+
+#include <limits.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "timing.h"
+
+namespace cortisol {
+
+using mongo::BSONElement;
+using mongo::BSONObj;
+using mongo::BSONObjBuilder;
+using mongo::BSONObjIterator;
+
+/** A parsed query filter: an inclusive range and optionally a set of values, or else one exact value, for each field it mentions. */
+class MockStore::Matcher {
+  public:
+    class Cond {
+      public:
+        string field;
+        long long lo;
+        long long hi;
+        bool has_in;
+        vector<long long> in;  // sorted
+        BSONObj value;         // for equality with anything but a number (an _id, a subdocument), wrapped as its only field
+
+        explicit Cond(const string &f) : field(f), lo(LLONG_MIN), hi(LLONG_MAX), has_in(false) {}
+
+        bool matches(const BSONElement &e) const {
+            if (!value.isEmpty()) {
+                return e.ok() && e.woCompare(value.firstElement(), false) == 0;
+            }
+            if (!e.ok() || !e.isNumber()) {
+                return false;
+            }
+            return matches(e.numberLong());
+        }
+
+        bool matches(long long x) const {
+            return x >= lo && x <= hi && (!has_in || std::binary_search(in.begin(), in.end(), x));
+        }
+    };
+
+    vector<Cond> conds;
+    const Cond *key;  // the condition on "a", if any
+    bool reverse;     // sort by a descending
+
+    /**
+     * Parses query.  If wrapped, as for a find, it may be wrapped with
+     * $query and $orderby; otherwise, as for a write's selector, it is
+     * taken literally, like the server does.
+     */
+    Matcher(const BSONObj &query, bool wrapped) : key(NULL), reverse(false) {
+        BSONObj filter = query;
+        BSONElement q;
+        if (wrapped) {
+            q = query["$query"].ok() ? query["$query"] : query["query"];
+        }
+        if (q.ok() && q.isABSONObj()) {
+            filter = q.embeddedObject();
+            BSONElement order = query["$orderby"].ok() ? query["$orderby"] : query["orderby"];
+            if (order.ok()) {
+                BSONObj o = order.embeddedObject();
+                if (o.nFields() != 1 || strcmp(o.firstElementFieldName(), "a") != 0) {
+                    throw std::runtime_error("mock backend can only sort on a: " + query.toString());
+                }
+                reverse = o.firstElement().numberLong() < 0;
+            }
+        }
+
+        BSONObjIterator it(filter);
+        while (it.more()) {
+            BSONElement e = it.next();
+            if (e.fieldName()[0] == '$') {
+                // The server doesn't know top level operators like $query in a write's selector either.
+                throw std::runtime_error("mock backend can't run query " + query.toString());
+            }
+            Cond c(e.fieldName());
+            if (e.isNumber()) {
+                c.lo = c.hi = e.numberLong();
+            } else if (!e.isABSONObj() || e.embeddedObject().firstElementFieldName()[0] != '$') {
+                c.value = e.wrap();
+            } else {
+                BSONObjIterator ops(e.embeddedObject());
+                while (ops.more()) {
+                    BSONElement op = ops.next();
+                    const char *name = op.fieldName();
+                    if (strcmp(name, "$in") == 0) {
+                        c.has_in = true;
+                        BSONObjIterator vals(op.embeddedObject());
+                        while (vals.more()) {
+                            c.in.push_back(vals.next().numberLong());
+                        }
+                        std::sort(c.in.begin(), c.in.end());
+                        c.in.erase(std::unique(c.in.begin(), c.in.end()), c.in.end());
+                    } else if (strcmp(name, "$gte") == 0) {
+                        c.lo = std::max(c.lo, op.numberLong());
+                    } else if (strcmp(name, "$gt") == 0) {
+                        c.lo = std::max(c.lo, op.numberLong() + 1);
+                    } else if (strcmp(name, "$lte") == 0) {
+                        c.hi = std::min(c.hi, op.numberLong());
+                    } else if (strcmp(name, "$lt") == 0) {
+                        c.hi = std::min(c.hi, op.numberLong() - 1);
+                    } else {
+                        throw std::runtime_error("mock backend can't run query " + query.toString());
+                    }
+                }
+            }
+            conds.push_back(c);
+        }
+        for (auto c = conds.begin(); c != conds.end(); ++c) {
+            if (c->field == "a" && c->value.isEmpty()) {
+                key = &*c;
+            }
+        }
+    }
+
+    bool matches(const BSONObj &doc) const {
+        for (auto c = conds.begin(); c != conds.end(); ++c) {
+            if (!c->matches(doc[c->field])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+size_t MockStore::shards = 16;
+double MockStore::latency = 0;
+po::options_description MockStore::options_description() {
+    po::options_description desc("Mock backend");
+    desc.add_options()
+            ("mock.shards",  po::value(&shards)->default_value(shards),   "# of independently locked slices of each mock collection.")
+            ("mock.latency", po::value(&latency)->default_value(latency), "Artificial latency added to every mock request (us).")
+            ;
+    return desc;
+}
+
+void MockStore::delay() {
+    if (latency <= 0) {
+        return;
+    }
+    const timestamp_t until = now() + secs_to_ts(latency / 1000000.0);
+    // Sleeping takes at least ~50us, so spin for anything shorter.
+    if (latency > 100) {
+        usleep(latency - 50);
+    }
+    while (now() < until) {
+        sched_yield();
+    }
+}
+
+MockStore::MockStore(size_t nshards, uint64_t keyspace) : _keyspace(std::max<uint64_t>(keyspace, 1)) {
+    nshards = std::max<size_t>(nshards, 1);
+    for (size_t i = 0; i < nshards; ++i) {
+        _shards.push_back(unique_ptr<Shard>(new Shard));
+    }
+}
+
+MockStore &MockStore::get(const string &ns, uint64_t keyspace) {
+    static std::mutex mutex;
+    static std::map<string, unique_ptr<MockStore> > stores;
+    std::lock_guard<std::mutex> lk(mutex);
+    unique_ptr<MockStore> &store = stores[ns];
+    if (!store) {
+        store.reset(new MockStore(shards, keyspace));
+    }
+    return *store;
+}
+
+size_t MockStore::shard_of(long long a) const {
+    if (a <= 0) {
+        return 0;
+    }
+    const uint64_t i = (unsigned __int128) a * _shards.size() / _keyspace;
+    return std::min<uint64_t>(i, _shards.size() - 1);
+}
+
+template<typename F>
+bool MockStore::visit(const Matcher &m, bool reverse, F f) {
+    // Every value of a to look at, as inclusive ranges.
+    vector<std::pair<long long, long long> > ranges;
+    if (m.key == NULL) {
+        ranges.push_back(std::make_pair(LLONG_MIN, LLONG_MAX));
+    } else if (m.key->has_in) {
+        for (auto v = m.key->in.begin(); v != m.key->in.end(); ++v) {
+            if (m.key->matches(*v)) {
+                ranges.push_back(std::make_pair(*v, *v));
+            }
+        }
+    } else if (m.key->lo <= m.key->hi) {
+        ranges.push_back(std::make_pair(m.key->lo, m.key->hi));
+    }
+    if (reverse) {
+        std::reverse(ranges.begin(), ranges.end());
+    }
+
+    for (auto r = ranges.begin(); r != ranges.end(); ++r) {
+        const size_t first = shard_of(r->first);
+        const size_t last = shard_of(r->second);
+        for (size_t n = 0; n <= last - first; ++n) {
+            Shard &s = *_shards[reverse ? last - n : first + n];
+            std::lock_guard<std::mutex> lk(s.mutex);
+            doc_iterator begin = s.docs.lower_bound(r->first);
+            doc_iterator end = s.docs.upper_bound(r->second);
+            if (!reverse) {
+                for (doc_iterator it = begin; it != end; ++it) {
+                    if (m.matches(it->second) && !f(s.docs, it)) {
+                        return false;
+                    }
+                }
+            } else {
+                for (doc_iterator it = end; it != begin; ) {
+                    --it;
+                    if (m.matches(it->second) && !f(s.docs, it)) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool MockStore::take(const Matcher &m, bool reverse, BSONObj &doc) {
+    bool found = false;
+    visit(m, reverse, [&](std::multimap<long long, BSONObj> &docs, doc_iterator it) {
+            doc = it->second;
+            docs.erase(it);
+            found = true;
+            return false;
+        });
+    return found;
+}
+
+void MockStore::put(const BSONObj &doc) {
+    const long long a = doc["a"].numberLong();
+    Shard &s = *_shards[shard_of(a)];
+    std::lock_guard<std::mutex> lk(s.mutex);
+    s.docs.insert(std::make_pair(a, doc));
+}
+
+void MockStore::drop() {
+    for (auto s = _shards.begin(); s != _shards.end(); ++s) {
+        std::lock_guard<std::mutex> lk((*s)->mutex);
+        (*s)->docs.clear();
+    }
+}
+
+void MockStore::insert(const vector<BSONObj> &docs) {
+    for (auto it = docs.begin(); it != docs.end(); ++it) {
+        put(it->getOwned());
+    }
+}
+
+/** @return doc with update's $inc applied. */
+static BSONObj apply_inc(const BSONObj &doc, const BSONObj &update) {
+    BSONObj inc;
+    BSONObjIterator ops(update);
+    while (ops.more()) {
+        BSONElement op = ops.next();
+        if (strcmp(op.fieldName(), "$inc") != 0 || !op.isABSONObj()) {
+            throw std::runtime_error("mock backend only supports $inc updates: " + update.toString());
+        }
+        inc = op.embeddedObject();
+    }
+
+    BSONObjBuilder b;
+    BSONObjIterator it(doc);
+    while (it.more()) {
+        BSONElement e = it.next();
+        BSONElement d = inc[e.fieldName()];
+        if (d.ok() && e.isNumber()) {
+            b.append(e.fieldName(), e.numberLong() + d.numberLong());
+        } else {
+            b.append(e);
+        }
+    }
+    BSONObjIterator added(inc);
+    while (added.more()) {
+        BSONElement d = added.next();
+        if (!doc.hasField(d.fieldName())) {
+            b.append(d.fieldName(), d.numberLong());
+        }
+    }
+    return b.obj();
+}
+
+uint64_t MockStore::update(const BSONObj &query, const BSONObj &update) {
+    Matcher m(query, false);
+    BSONObj doc;
+    if (!take(m, m.reverse, doc)) {
+        return 0;
+    }
+    // Not atomic with the take, but the mock only promises to do the same work, not isolation.
+    put(apply_inc(doc, update));
+    return 1;
+}
+
+uint64_t MockStore::remove(const BSONObj &query, bool just_one) {
+    Matcher m(query, false);
+    BSONObj doc;
+    uint64_t n = 0;
+    while (take(m, m.reverse, doc)) {
+        ++n;
+        if (just_one) {
+            break;
+        }
+    }
+    return n;
+}
+
+/** @return doc with only the fields an inclusion projection asks for. */
+static BSONObj project(const BSONObj &doc, const BSONObj &fields) {
+    BSONElement id = fields["_id"];
+    const bool with_id = !id.ok() || id.trueValue();
+    BSONObjBuilder b;
+    BSONObjIterator it(doc);
+    while (it.more()) {
+        BSONElement e = it.next();
+        if (strcmp(e.fieldName(), "_id") == 0 ? with_id : fields[e.fieldName()].trueValue()) {
+            b.append(e);
+        }
+    }
+    return b.obj();
+}
+
+uint64_t MockStore::query(const BSONObj &query, const BSONObj *fields, int limit, const std::function<void(const BSONObj&)> &f) {
+    Matcher m(query, true);
+    uint64_t n = 0;
+    visit(m, m.reverse, [&](std::multimap<long long, BSONObj> &, doc_iterator it) {
+            f(fields != NULL ? project(it->second, *fields) : it->second);
+            ++n;
+            return limit <= 0 || n < (uint64_t) limit;
+        });
+    return n;
+}
+
+} // namespace cortisol
@@ -0,0 +1,91 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "mongo/client/dbclient.h"
+
+#include "aligned.h"
+
+namespace cortisol {
+
+namespace po = boost::program_options;
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+/**
+ * An in-memory stand-in for one collection, for running cortisol without a
+ * server.  Documents are kept ordered by "a" in shards that each own a
+ * slice of the key space, so point lookups and most ranges lock one shard.
+ *
+ * It only understands the queries cortisol sends: equality, $gt, $gte, $lt,
+ * $lte and $in on numeric fields, equality on anything else, inclusion
+ * projections, and $inc updates.  Anything else throws.  Finds may be
+ * wrapped with $query/query and $orderby/orderby (on "a" only; $hint is
+ * ignored), but like the server's, update and remove selectors are matched
+ * literally, so they can't be sorted.
+ */
+class MockStore {
+    class Shard : public cache_aligned {
+      public:
+        alignas(cache_line_size) std::mutex mutex;
+        std::multimap<long long, mongo::BSONObj> docs;
+    };
+
+    const uint64_t _keyspace;
+    vector<unique_ptr<Shard> > _shards;
+
+    size_t shard_of(long long a) const;
+
+    class Matcher;
+    typedef std::multimap<long long, mongo::BSONObj>::iterator doc_iterator;
+    /**
+     * Calls f(docs, it) on each document matching m, in order of a
+     * (descending if reverse), with its shard locked, until f returns
+     * false.  @return false if f did.
+     */
+    template<typename F>
+    bool visit(const Matcher &m, bool reverse, F f);
+    /** Removes the first document matching m into doc.  @return false if there were none. */
+    bool take(const Matcher &m, bool reverse, mongo::BSONObj &doc);
+    void put(const mongo::BSONObj &doc);
+
+  public:
+    MockStore(size_t nshards, uint64_t keyspace);
+    MockStore(const MockStore&) = delete;
+    MockStore& operator=(const MockStore&) = delete;
+
+    /** @return the store for ns, created empty the first time, with its shards splitting [0, keyspace) evenly. */
+    static MockStore &get(const string &ns, uint64_t keyspace);
+
+    void drop();
+    void insert(const vector<mongo::BSONObj> &docs);
+    /** Applies update to the first document matching query.  @return the # of documents updated. */
+    uint64_t update(const mongo::BSONObj &query, const mongo::BSONObj &update);
+    /** @return the # of documents removed. */
+    uint64_t remove(const mongo::BSONObj &query, bool just_one);
+    /** Calls f on each result, at most limit of them if limit > 0.  @return the # of results. */
+    uint64_t query(const mongo::BSONObj &query, const mongo::BSONObj *fields, int limit, const std::function<void(const mongo::BSONObj&)> &f);
+
+    /** Waits for the configured latency, to stand in for a server's response time. */
+    static void delay();
+
+    // config
+    static size_t shards;
+    static double latency;
+    static po::options_description options_description();
+};
+
+} // namespace cortisol
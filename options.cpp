@@ -1,15 +1,25 @@
 /* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <utility>
 
+#include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 
+#include "async.h"
+#include "backend.h"
 #include "cortisol.h"
+#include "dist.h"
 #include "options.h"
 #include "output.h"
+#include "placement.h"
+#include "report.h"
+#include "server_stats.h"
+#include "slow_ops.h"
 
 namespace cortisol {
 
@@ -17,10 +27,45 @@ using std::cout;
 using std::cerr;
 using std::endl;
 using std::ifstream;
+using std::pair;
 using std::string;
 
 namespace po = boost::program_options;
 
+std::istream &operator>>(std::istream &is, ConnectionMode &mode) {
+    string s;
+    is >> s;
+    if (s == "pooled") {
+        mode = ConnectionMode::pooled;
+    } else if (s == "dedicated") {
+        mode = ConnectionMode::dedicated;
+    } else {
+        is.setstate(std::ios_base::failbit);
+    }
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const ConnectionMode &mode) {
+    return os << (mode == ConnectionMode::pooled ? "pooled" : "dedicated");
+}
+
+std::istream &operator>>(std::istream &is, Engine &engine) {
+    string s;
+    is >> s;
+    if (s == "threads") {
+        engine = Engine::threads;
+    } else if (s == "async") {
+        engine = Engine::async;
+    } else {
+        is.setstate(std::ios_base::failbit);
+    }
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const Engine &engine) {
+    return os << (engine == Engine::async ? "async" : "threads");
+}
+
 Options Options::default_options() {
     Options opts;
     opts.create = true;
@@ -28,6 +73,9 @@ Options Options::default_options() {
     opts.keep_database = false;
     opts.loader = true;
     opts.host = "127.0.0.1";
+    opts.connection_mode = ConnectionMode::dedicated;
+    opts.backend = BackendType::mongo;
+    opts.engine = Engine::threads;
     opts.seconds = 60;
     return opts;
 }
@@ -36,6 +84,8 @@ po::options_description Options::options_description() {
     po::options_description conn_options("Connection");
     conn_options.add_options()
             ("host", po::value(&host)->default_value(host), "Host to connect to.  Can also be a replica set with full \"mongodb://host1,host2,host3/?replicaSet=rsName\" syntax.")
+            ("connection-mode", po::value(&connection_mode)->default_value(connection_mode), "How stressors connect: \"dedicated\" (one long-lived connection per thread) or \"pooled\" (from the shared pool on every op).")
+            ("backend", po::value(&backend)->default_value(backend), "What to stress: \"mongo\" (the server at --host) or \"mock\" (an in-process store, to measure cortisol itself).")
             ;
         
 
@@ -46,22 +96,155 @@ po::options_description Options::options_description() {
             ("keep-database",   po::value(&keep_database)->default_value(keep_database),        "Don't drop the existing database before running.")
             ("loader",          po::value(&loader)->default_value(loader),                      "Use the bulk loader to load collections.")
             ("seconds",         po::value(&seconds)->default_value(seconds),                    "Time to run stressors for.")
+            ("engine",          po::value(&engine)->default_value(engine),                      "How stressors run: \"threads\" (a thread and connection each) or \"async\" (many connections on each of --async.workers threads).")
             ;
 
     po::options_description all_options("General");
     all_options
             .add(conn_options)
+            .add(MockStore::options_description())
             .add(exec_options)
+            .add(AsyncEngine::options_description())
+            .add(Placement::options_description())
+            .add(Dist::options_description())
             .add(Collection::options_description())
+            .add(Collection::fill_options_description())
             .add(out::options_description())
+            .add(Reporter::options_description())
+            .add(SlowOps::options_description())
+            .add(ServerStats::options_description())
             .add(UpdateRunner::options_description())
             .add(PointQueryRunner::options_description())
             .add(RangeQueryRunner::options_description())
+            .add(IndexQueryRunner::options_description())
+            .add(MixedRunner::options_description())
+            .add(InsertRunner::options_description())
+            .add(DeleteRunner::options_description())
+            .add(ChurnRunner::options_description())
             ;
     return all_options;
 }
 
-bool parse_cmdline(int argc, const char *argv[], Options &opts) {
+/**
+ * Picks the [phase.<id>] settings out of a config file's unregistered
+ * options, adding phases to opts in the order they first appear.
+ * @throws po::unknown_option for anything else we don't know about.
+ */
+static void parse_phases(const po::parsed_options &parsed, Options &opts) {
+    for (auto it = parsed.options.begin(); it != parsed.options.end(); ++it) {
+        if (!it->unregistered) {
+            continue;
+        }
+        const string &key = it->string_key;
+        const string prefix("phase.");
+        size_t id_end = key.find('.', prefix.size());
+        if (key.compare(0, prefix.size(), prefix) != 0 || id_end == string::npos || it->value.size() != 1) {
+            throw po::unknown_option(key);
+        }
+        const string id = key.substr(prefix.size(), id_end - prefix.size());
+        const string setting = key.substr(id_end + 1);
+        const string &value = it->value[0];
+
+        auto phase = std::find_if(opts.phases.begin(), opts.phases.end(), [&id](const Phase &p) { return p.id == id; });
+        if (phase == opts.phases.end()) {
+            opts.phases.push_back(Phase());
+            phase = opts.phases.end() - 1;
+            phase->id = id;
+            phase->name = id;
+        }
+
+        try {
+            size_t dot = setting.rfind('.');
+            if (setting == "name") {
+                phase->name = value;
+            } else if (setting == "seconds") {
+                phase->seconds = boost::lexical_cast<double>(value);
+            } else if (parsed.description->find_nothrow(setting, false) == NULL) {
+                // Only stressors' own <section>.threads and <section>.rate can be set per phase.
+                throw po::unknown_option(key);
+            } else if (dot != string::npos && setting.substr(dot + 1) == "threads") {
+                phase->threads[setting.substr(0, dot)] = boost::lexical_cast<size_t>(value);
+            } else if (dot != string::npos && setting.substr(dot + 1) == "rate") {
+                phase->rates[setting.substr(0, dot)] = boost::lexical_cast<double>(value);
+            } else {
+                throw po::unknown_option(key);
+            }
+        } catch (boost::bad_lexical_cast &e) {
+            throw po::invalid_option_value(key + "=" + value);
+        }
+    }
+}
+
+/** @return the most threads type gets in any phase. */
+static size_t max_threads(const Options &opts, const RunnerType &type) {
+    if (opts.phases.empty()) {
+        return *type.threads;
+    }
+    size_t n = 0;
+    for (auto phase = opts.phases.begin(); phase != opts.phases.end(); ++phase) {
+        n = std::max(n, type.phase_threads(*phase));
+    }
+    return n;
+}
+
+/** @return whether the stressor configured in section will run at all, on its own or as part of the mix. */
+static bool will_run(const Options &opts, const string &section) {
+    if (max_threads(opts, *find_runner_type(section)) > 0) {
+        return true;
+    }
+    if (max_threads(opts, *find_runner_type("mixed")) == 0) {
+        return false;
+    }
+    const vector<pair<string, double> > &ops = MixedRunner::weights.ops;
+    for (auto it = ops.begin(); it != ops.end(); ++it) {
+        if (it->first == section && it->second > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Rejects settings that parse but can't be run.
+ * @throws po::error saying which.
+ */
+static void check_options(const Options &opts) {
+    for (auto phase = opts.phases.begin(); phase != opts.phases.end(); ++phase) {
+        if (!(phase->seconds > 0)) {
+            throw po::error("phase." + phase->id + ".seconds must be set, and positive");
+        }
+    }
+
+    if (UpdateRunner::batch < 1) {
+        throw po::error("update.batch must be at least 1");
+    }
+    if (PointQueryRunner::batch < 1) {
+        throw po::error("point_query.batch must be at least 1");
+    }
+    if (InsertRunner::batch < 1) {
+        throw po::error("insert.batch must be at least 1");
+    }
+    if (ChurnRunner::batch < 1) {
+        throw po::error("churn.batch must be at least 1");
+    }
+
+    if (will_run(opts, "index_query") && Collection::indexes == 0) {
+        throw po::error("index_query needs at least one index (--indexes)");
+    }
+    if (IndexQueryRunner::stride > 0 && IndexQueryRunner::stride >= Collection::documents) {
+        throw po::error("index_query.stride must be less than --documents");
+    }
+    if (will_run(opts, "range_query") && RangeQueryRunner::stride >= Collection::documents) {
+        throw po::error("range_query.stride must be less than --documents");
+    }
+    // The async engine's getLastError doesn't come back until the op is
+    // done, so remove_near can't see that its $gte missed and fall back.
+    if (opts.engine == Engine::async && (will_run(opts, "delete") || will_run(opts, "churn"))) {
+        throw po::error("delete and churn don't work with --engine=async yet");
+    }
+}
+
+bool parse_cmdline(int argc, const char *argv[], Options &opts, const std::map<string, string> &sent_files) {
     po::options_description visible_options("Options");
     visible_options.add_options()
             ("help,h", "Get help.")
@@ -92,10 +275,21 @@ bool parse_cmdline(int argc, const char *argv[], Options &opts) {
         po::variables_map vm;
         if (cli_vm.count("response-file")) {
             const vector<string> files = cli_vm["response-file"].as<vector<string> >();
+            auto parse_file = [&all_options, &opts, &vm](std::istream &is) {
+                po::parsed_options parsed = po::parse_config_file(is, all_options, true);
+                parse_phases(parsed, opts);
+                po::store(parsed, vm);
+            };
             for (vector<string>::const_iterator it = files.begin(); it != files.end(); ++it) {
+                auto sent = sent_files.find(*it);
+                if (sent != sent_files.end()) {
+                    std::istringstream iss(sent->second);
+                    parse_file(iss);
+                    continue;
+                }
                 ifstream ifs(it->c_str());
                 if (ifs.good()) {
-                    po::store(po::parse_config_file(ifs, all_options), vm);
+                    parse_file(ifs);
                 }
             }
         }
@@ -108,6 +302,7 @@ bool parse_cmdline(int argc, const char *argv[], Options &opts) {
         }
 
         po::notify(vm);
+        check_options(opts);
 
         return true;
     } catch(po::error &e) {
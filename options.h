@@ -2,16 +2,55 @@
 
 #pragma once
 
+#include <iostream>
+#include <map>
 #include <string>
+#include <vector>
 
 #include <boost/program_options.hpp>
 
+#include "backend.h"
+
 namespace cortisol {
 
 using std::string;
+using std::vector;
 
 namespace po = boost::program_options;
 
+/** How stressor threads get their connections. */
+enum class ConnectionMode {
+    pooled,     // check one out of the global pool around every step
+    dedicated   // each runner keeps its own connection for the whole run
+};
+
+std::istream &operator>>(std::istream &is, ConnectionMode &mode);
+std::ostream &operator<<(std::ostream &os, const ConnectionMode &mode);
+
+/** What drives the stressors. */
+enum class Engine {
+    threads,  // a thread per runner, each blocking on its own driver connection
+    async     // a few threads, each multiplexing many runners' connections (see async.h)
+};
+
+std::istream &operator>>(std::istream &is, Engine &engine);
+std::ostream &operator<<(std::ostream &os, const Engine &engine);
+
+/**
+ * One stage of a phased run, from a [phase.<id>] section in a config
+ * file.  Stressor settings it doesn't mention keep their usual values.
+ */
+class Phase {
+  public:
+    string id;
+    string name;  // for reports, defaults to id
+    double seconds;
+    std::map<string, size_t> threads;  // keyed by stressor config section, e.g. "update"
+    std::map<string, double> rates;
+
+    Phase() : seconds(0) {}
+};
+
 class Options {
     Options() {}
   public:
@@ -20,14 +59,24 @@ class Options {
     bool keep_database;
     bool loader;
     string host;
+    ConnectionMode connection_mode;
+    BackendType backend;
+    Engine engine;
 
     int seconds;
+    vector<Phase> phases;
 
     static Options default_options();
     explicit Options(const po::variables_map &vm);
     po::options_description options_description();
 };
 
-bool parse_cmdline(int argc, const char *argv[], Options &opts);
+/**
+ * Parses argv and any @config files it names into opts and the config
+ * statics.  Files named in sent_files are read from there instead of from
+ * disk (a dist worker gets its coordinator's that way).
+ * @return false if we should exit instead of running.
+ */
+bool parse_cmdline(int argc, const char *argv[], Options &opts, const std::map<string, string> &sent_files = std::map<string, string>());
 
 } // namespace cortisol
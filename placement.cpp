@@ -0,0 +1,229 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "placement.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "aligned.h"
+
+namespace cortisol {
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+std::istream &operator>>(std::istream &is, CpuList &l) {
+    string s;
+    is >> s;
+    std::replace(s.begin(), s.end(), ',', ' ');
+    std::stringstream ss(s);
+    CpuList r;
+    string range;
+    while (ss >> range) {
+        char *end;
+        const long lo = strtol(range.c_str(), &end, 10);
+        long hi = lo;
+        if (*end == '-') {
+            hi = strtol(end + 1, &end, 10);
+        }
+        if (end == range.c_str() || *end != '\0' || lo < 0 || hi < lo || hi >= CPU_SETSIZE) {
+            is.setstate(std::ios_base::failbit);
+            return is;
+        }
+        for (long cpu = lo; cpu <= hi; ++cpu) {
+            r.cpus.push_back(cpu);
+        }
+    }
+    std::sort(r.cpus.begin(), r.cpus.end());
+    r.cpus.erase(std::unique(r.cpus.begin(), r.cpus.end()), r.cpus.end());
+    l = r;
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const CpuList &l) {
+    for (size_t i = 0; i < l.cpus.size(); ) {
+        size_t j = i;
+        while (j + 1 < l.cpus.size() && l.cpus[j + 1] == l.cpus[j] + 1) {
+            ++j;
+        }
+        if (i != 0) {
+            os << ",";
+        }
+        os << l.cpus[i];
+        if (j != i) {
+            os << "-" << l.cpus[j];
+        }
+        i = j + 1;
+    }
+    return os;
+}
+
+CpuList Placement::cpus;
+CpuList Placement::avoid_cpus;
+bool Placement::numa = false;
+po::options_description Placement::options_description() {
+    po::options_description desc("Placement");
+    desc.add_options()
+            ("cpus",       po::value(&cpus)->default_value(cpus),             "Pin cortisol's threads to these CPUs, one each in turn, like 0-15,32-47 (default: wherever they're allowed).")
+            ("avoid_cpus", po::value(&avoid_cpus)->default_value(avoid_cpus), "Keep off these CPUs, e.g. the ones mongod is running on.")
+            ("numa",       po::value(&numa)->default_value(numa),             "Deal threads out round the NUMA nodes, and allocate their stats and buffers on their own node.")
+            ;
+    return desc;
+}
+
+Placement *Placement::_instance = NULL;
+
+/** Asks for the calling thread's new pages to come from node, or from anywhere if node < 0. */
+static void set_thread_node(int node) {
+    if (node < 0) {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+        return;
+    }
+    unsigned long mask[16] = {0};
+    const size_t bits = 8 * sizeof mask[0];
+    if (static_cast<size_t>(node) >= bits * 16) {
+        return;
+    }
+    mask[node / bits] = 1UL << (node % bits);
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, bits * 16);
+}
+
+/** @return the CPUs of each NUMA node in sysfs, by node number, or nothing if there's no sysfs. */
+static vector<std::pair<int, CpuList> > numa_nodes() {
+    vector<std::pair<int, CpuList> > nodes;
+    const string dir = "/sys/devices/system/node";
+    DIR *d = opendir(dir.c_str());
+    if (d == NULL) {
+        return nodes;
+    }
+    while (struct dirent *e = readdir(d)) {
+        int n;
+        char rest;
+        if (sscanf(e->d_name, "node%d%c", &n, &rest) != 1) {
+            continue;
+        }
+        std::ifstream ifs((dir + "/" + e->d_name + "/cpulist").c_str());
+        CpuList l;
+        if (ifs >> l) {
+            nodes.push_back(std::make_pair(n, l));
+        }
+    }
+    closedir(d);
+    std::sort(nodes.begin(), nodes.end(), [](const std::pair<int, CpuList> &a, const std::pair<int, CpuList> &b) { return a.first < b.first; });
+    return nodes;
+}
+
+Placement::Placement() : _next(0) {
+    if (cpus.cpus.empty() && avoid_cpus.cpus.empty() && !numa) {
+        return;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof allowed, &allowed) != 0) {
+        throw std::runtime_error(string("sched_getaffinity: ") + strerror(errno));
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        if (!cpus.cpus.empty() && !std::binary_search(cpus.cpus.begin(), cpus.cpus.end(), cpu)) {
+            continue;
+        }
+        if (std::binary_search(avoid_cpus.cpus.begin(), avoid_cpus.cpus.end(), cpu)) {
+            continue;
+        }
+        _cpus.push_back(cpu);
+    }
+    if (_cpus.empty()) {
+        throw std::runtime_error("no CPUs left to run on with --cpus and --avoid_cpus");
+    }
+    // Threads we don't place (main, reporter, ...) inherit this.
+    cpu_set_t usable;
+    CPU_ZERO(&usable);
+    for (auto it = _cpus.begin(); it != _cpus.end(); ++it) {
+        CPU_SET(*it, &usable);
+    }
+    sched_setaffinity(0, sizeof usable, &usable);
+
+    if (numa) {
+        const vector<std::pair<int, CpuList> > nodes = numa_nodes();
+        for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+            vector<int> mine;
+            std::set_intersection(it->second.cpus.begin(), it->second.cpus.end(), _cpus.begin(), _cpus.end(), std::back_inserter(mine));
+            if (!mine.empty()) {
+                _nodes.push_back(it->first);
+                _node_cpus.push_back(mine);
+            }
+        }
+        if (_nodes.empty()) {
+            cerr << "no NUMA topology in /sys, --numa only pins threads" << endl;
+        }
+    }
+}
+
+void Placement::init() {
+    if (_instance == NULL) {
+        _instance = new Placement();
+    }
+}
+
+int Placement::node(size_t slot) const {
+    return _nodes.empty() ? -1 : _nodes[slot % _nodes.size()];
+}
+
+void Placement::enter(size_t slot) const {
+    if (!on()) {
+        return;
+    }
+    int cpu;
+    if (_nodes.empty()) {
+        cpu = _cpus[slot % _cpus.size()];
+    } else {
+        const vector<int> &node_cpus = _node_cpus[slot % _nodes.size()];
+        cpu = node_cpus[(slot / _nodes.size()) % node_cpus.size()];
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+    if (err != 0) {
+        cerr << "couldn't pin a thread to CPU " << cpu << ": " << strerror(err) << endl;
+    }
+    const int n = node(slot);
+    if (n >= 0) {
+        set_thread_node(n);
+        alloc_node() = n;
+    }
+}
+
+Placement::scoped_node::scoped_node(const Placement &p, size_t slot) : _node(p.node(slot)) {
+    if (_node >= 0) {
+        set_thread_node(_node);
+        alloc_node() = _node;
+    }
+}
+
+Placement::scoped_node::~scoped_node() {
+    if (_node >= 0) {
+        set_thread_node(-1);
+        alloc_node() = -1;
+    }
+}
+
+} // namespace cortisol
@@ -0,0 +1,95 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <assert.h>
+
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+namespace cortisol {
+
+namespace po = boost::program_options;
+
+using std::vector;
+
+/** A set of CPUs, written like "0-15,32-47". */
+class CpuList {
+  public:
+    vector<int> cpus;  // sorted, no duplicates
+};
+
+std::istream &operator>>(std::istream &is, CpuList &l);
+std::ostream &operator<<(std::ostream &os, const CpuList &l);
+
+/**
+ * Which CPU and NUMA node each of cortisol's threads uses.  Threads are
+ * handed numbered slots (runners their index, fill threads one each in
+ * turn), and slot n is pinned to the nth usable CPU, going round the NUMA
+ * nodes first with --numa.  With --numa, a slot's thread also allocates
+ * from its node, and so do runners' stats and buffers, which are built
+ * under a scoped_node for the slot of the thread that will use them.
+ *
+ * The topology comes from /sys/devices/system/node, memory is placed
+ * with mbind and set_mempolicy, and without any of the options all of
+ * this does nothing.
+ */
+class Placement {
+    vector<int> _cpus;                 // usable CPUs
+    vector<int> _nodes;                // NUMA nodes with usable CPUs, if we're placing memory
+    vector<vector<int> > _node_cpus;   // usable CPUs of each of _nodes
+    std::atomic<size_t> _next;
+
+    Placement();
+
+  public:
+    Placement(const Placement&) = delete;
+    Placement& operator=(const Placement&) = delete;
+
+    /** Works out the usable CPUs and nodes from the options.  Call from main() once options are parsed.  @throws std::runtime_error if no CPUs are left. */
+    static void init();
+
+    static Placement &get() {
+        assert(_instance != NULL);
+        return *_instance;
+    }
+
+    bool on() const {
+        return !_cpus.empty();
+    }
+
+    /** @return slot's NUMA node, or -1 if we aren't placing memory. */
+    int node(size_t slot) const;
+
+    /** Pins the calling thread to slot's CPU, and with --numa, makes it allocate on slot's node. */
+    void enter(size_t slot) const;
+
+    /** enter()s the next slot in turn, for threads that aren't numbered. */
+    void enter_next() {
+        enter(_next++);
+    }
+
+    /** While it exists, memory the calling thread allocates (cache_aligned objects in particular) goes to slot's node. */
+    class scoped_node {
+        const int _node;
+      public:
+        scoped_node(const Placement &p, size_t slot);
+        ~scoped_node();
+        scoped_node(const scoped_node&) = delete;
+        scoped_node& operator=(const scoped_node&) = delete;
+    };
+
+    // config
+    static CpuList cpus;
+    static CpuList avoid_cpus;
+    static bool numa;
+    static po::options_description options_description();
+
+  private:
+    static Placement *_instance;
+};
+
+} // namespace cortisol
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <condition_variable>
 #include <queue>
 #include <thread>
@@ -50,6 +51,18 @@ class Queue {
         _q.push(std::forward<U>(x));
         _front_cond.notify_one();
     }
+    /** Waits up to timeout for an element, and pops it into x.  Safe with many consumers, unlike front()/pop(). */
+    template<class Rep, class Period>
+    bool pop_for(T &x, const std::chrono::duration<Rep, Period> &timeout) {
+        unique_lock<mutex> lk(_mutex);
+        if (!_front_cond.wait_for(lk, timeout, [this]() { return !_q.empty(); })) {
+            return false;
+        }
+        x = std::move(_q.front());
+        _q.pop();
+        _push_cond.notify_one();
+        return true;
+    }
     void pop() {
         lock_guard<mutex> lk(_mutex);
         _q.pop();
@@ -60,6 +73,7 @@ class Queue {
         while (!_q.empty()) {
             _q.pop();
         }
+        _push_cond.notify_all();
     }
 };
 
@@ -0,0 +1,414 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "report.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "counter.h"
+#include "histogram.h"
+#include "output.h"
+#include "schedule.h"
+
+namespace cortisol {
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::unique_ptr;
+
+using out::ofs;
+using out::ors;
+
+std::istream &operator>>(std::istream &is, OutputFormat &f) {
+    string s;
+    is >> s;
+    if (s == "tsv") {
+        f = OutputFormat::tsv;
+    } else if (s == "jsonl") {
+        f = OutputFormat::jsonl;
+    } else if (s == "binary") {
+        f = OutputFormat::binary;
+    } else {
+        is.setstate(std::ios_base::failbit);
+    }
+    return is;
+}
+
+std::ostream &operator<<(std::ostream &os, const OutputFormat &f) {
+    switch (f) {
+        case OutputFormat::jsonl:
+            return os << "jsonl";
+        case OutputFormat::binary:
+            return os << "binary";
+        case OutputFormat::tsv:
+        default:
+            return os << "tsv";
+    }
+}
+
+static const double quantiles[] = {0.50, 0.90, 0.99, 0.999};
+
+static double usecs(timestamp_t t) {
+    return ts_to_secs(t) * 1000000.0;
+}
+
+static double rate(uint64_t n, double secs) {
+    return secs > 0 ? n / secs : 0;
+}
+
+class Writer {
+  public:
+    virtual ~Writer() {}
+    /** server is the ServerSample taken with r, if there is one. */
+    virtual void write(const Report &r, const ServerSample *server) = 0;
+};
+
+/** Counters and sizes are whole numbers, and shouldn't come out as 1.23457e+09. */
+static void number(double v) {
+    if (v == (double) (long long) v) {
+        cout << (long long) v;
+    } else {
+        cout << v;
+    }
+}
+
+class TsvWriter : public Writer {
+    void header() {
+        cout << "# " << out::pad(8) << "phase" << ofs
+             << out::pad(18) << "ns" << ofs
+             << out::pad(10) << "type" << ofs
+             << out::pad(4) << "id" << ofs
+             << counter<size_t>::header() << ofs
+             << histogram::header() << ofs
+             << lateness::header() << ofs
+             << out::pad(14) << "i_bytes" << ofs
+             << out::pad(14) << "c_bytes" << ofs
+             << out::pad(12) << "i_docs" << ofs
+             << out::pad(12) << "c_docs" << ofs
+             << out::pad(12) << "docs/s" << ofs
+             << out::pad(14) << "bytes/s" << ofs
+             << out::pad(8) << "i_errs" << ofs
+             << out::pad(8) << "c_errs" << ors;
+    }
+
+    static size_t width(const ServerStat &s) {
+        return std::max<size_t>(14, s.name.size());
+    }
+
+    void server_header(const ServerSample &server) {
+        cout << "# " << out::pad(8) << "phase" << ofs
+             << out::pad(18) << "server";
+        for (auto it = server.stats.begin(); it != server.stats.end(); ++it) {
+            cout << ofs << out::pad(width(*it)) << it->name;
+        }
+        cout << ors;
+    }
+
+  public:
+    void write(const Report &r, const ServerSample *server) {
+        if (r.totals) {
+            cout << endl << "# TOTALS:" << endl;
+        } else if (r.header) {
+            header();
+            if (server != NULL) {
+                server_header(*server);
+            }
+        }
+        for (auto it = r.records.begin(); it != r.records.end(); ++it) {
+            const Record &rec = *it;
+            cout << out::pad(10) << rec.phase << ofs
+                 << out::pad(18) << rec.ns << ofs
+                 << out::pad(10) << rec.type << ofs
+                 << out::pad(4) << rec.id << ofs;
+            if (rec.total) {
+                cout << counter<size_t>::output_line(rec.c_ops, rec.elapsed) << ofs
+                     << histogram::output_line(rec.c_latency) << ofs
+                     << lateness::output_line(rec.c_late) << ofs
+                     << out::pad(14) << "       " << ofs;
+            } else {
+                cout << counter<size_t>::output_line(rec.ops, rec.c_ops, rec.period, rec.elapsed) << ofs
+                     << histogram::output_line(rec.latency, rec.c_latency) << ofs
+                     << lateness::output_line(rec.late, rec.c_late) << ofs
+                     << out::pad(14) << rec.bytes << ofs;
+            }
+            cout << out::pad(14) << rec.c_bytes << ofs;
+            if (rec.total) {
+                cout << out::pad(12) << "       " << ofs
+                     << out::pad(12) << rec.c_docs << ofs
+                     << out::pad(12) << (uint64_t) rate(rec.c_docs, rec.elapsed) << ofs
+                     << out::pad(14) << (uint64_t) rate(rec.c_bytes, rec.elapsed) << ofs
+                     << out::pad(8) << "       " << ofs;
+            } else {
+                cout << out::pad(12) << rec.docs << ofs
+                     << out::pad(12) << rec.c_docs << ofs
+                     << out::pad(12) << (uint64_t) rate(rec.docs, rec.period) << ofs
+                     << out::pad(14) << (uint64_t) rate(rec.bytes, rec.period) << ofs
+                     << out::pad(8) << rec.errors << ofs;
+            }
+            cout << out::pad(8) << rec.c_errors << ors;
+        }
+        if (server != NULL) {
+            cout << out::pad(10) << server->phase << ofs
+                 << out::pad(18) << "server";
+            for (auto it = server->stats.begin(); it != server->stats.end(); ++it) {
+                cout << ofs << out::pad(width(*it));
+                if (it->ok) {
+                    number(it->value);
+                } else {
+                    cout << "-";
+                }
+            }
+            cout << ors;
+        }
+        cout.flush();
+    }
+};
+
+class JsonWriter : public Writer {
+    static void str(const string &s) {
+        cout << '"';
+        for (string::const_iterator c = s.begin(); c != s.end(); ++c) {
+            if (*c == '"' || *c == '\\') {
+                cout << '\\' << *c;
+            } else if ((unsigned char) *c < 0x20) {
+                cout << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) *c << std::dec << std::setfill(' ');
+            } else {
+                cout << *c;
+            }
+        }
+        cout << '"';
+    }
+
+    static void latency(const char *key, const histogram::snapshot &s) {
+        static const char *names[] = {"p50", "p90", "p99", "p999"};
+        cout << ",\"" << key << "\":{";
+        for (size_t i = 0; i < sizeof quantiles / sizeof quantiles[0]; ++i) {
+            cout << "\"" << names[i] << "\":" << usecs(s.quantile(quantiles[i])) << ",";
+        }
+        cout << "\"max\":" << usecs(s.max()) << "}";
+    }
+
+    static void stats(const char *key, bool counters, const ServerSample &server) {
+        cout << ",\"" << key << "\":{";
+        bool first = true;
+        for (auto it = server.stats.begin(); it != server.stats.end(); ++it) {
+            if (it->counter == counters) {
+                cout << (first ? "" : ",");
+                str(it->name);
+                cout << ":";
+                if (it->ok) {
+                    number(it->value);
+                } else {
+                    cout << "null";
+                }
+                first = false;
+            }
+        }
+        cout << "}";
+    }
+
+  public:
+    void write(const Report &r, const ServerSample *server) {
+        cout << std::setprecision(6);
+        for (auto it = r.records.begin(); it != r.records.end(); ++it) {
+            const Record &rec = *it;
+            cout << "{\"phase\":";
+            str(rec.phase);
+            cout << ",\"ns\":";
+            str(rec.ns);
+            cout << ",\"type\":";
+            str(rec.type);
+            cout << ",\"id\":" << rec.id
+                 << ",\"total\":" << (rec.total ? "true" : "false")
+                 << ",\"elapsed\":" << rec.elapsed;
+            if (!rec.total) {
+                cout << ",\"period\":" << rec.period
+                     << ",\"ops\":" << rec.ops
+                     << ",\"rate\":" << rate(rec.ops, rec.period)
+                     << ",\"bytes\":" << rec.bytes
+                     << ",\"bytes_rate\":" << rate(rec.bytes, rec.period)
+                     << ",\"docs\":" << rec.docs
+                     << ",\"docs_rate\":" << rate(rec.docs, rec.period)
+                     << ",\"errors\":" << rec.errors
+                     << ",\"late\":" << rec.late.count();
+                latency("latency_us", rec.latency);
+            }
+            cout << ",\"c_ops\":" << rec.c_ops
+                 << ",\"c_rate\":" << rate(rec.c_ops, rec.elapsed)
+                 << ",\"c_bytes\":" << rec.c_bytes
+                 << ",\"c_bytes_rate\":" << rate(rec.c_bytes, rec.elapsed)
+                 << ",\"c_docs\":" << rec.c_docs
+                 << ",\"c_docs_rate\":" << rate(rec.c_docs, rec.elapsed)
+                 << ",\"c_errors\":" << rec.c_errors
+                 << ",\"c_late\":" << rec.c_late.count();
+            latency("c_latency_us", rec.c_latency);
+            cout << "}\n";
+        }
+        if (server != NULL) {
+            cout << "{\"phase\":";
+            str(server->phase);
+            cout << ",\"server\":true"
+                 << ",\"period\":" << server->period;
+            stats("deltas", true, *server);
+            stats("gauges", false, *server);
+            cout << "}\n";
+        }
+        cout.flush();
+    }
+};
+
+/**
+ * Each record is written in host byte order as:
+ *
+ *   uint32_t  size of the rest of the record
+ *   uint8_t   1 for totals, 0 for an interval
+ *   3x (uint16_t length, chars)  phase, ns, type
+ *   uint32_t  id
+ *   double    period, elapsed (s)
+ *   uint64_t  ops, c_ops, bytes, c_bytes, docs, c_docs, errors, c_errors,
+ *             late, c_late
+ *   double    p50, p90, p99, p99.9, max latency (us) for the interval
+ *   double    p50, p90, p99, p99.9, max latency (us) for the whole run
+ *
+ * A ServerSample taken with an interval follows its records as:
+ *
+ *   uint32_t  size of the rest of the record
+ *   uint8_t   2
+ *   (uint16_t length, chars)  phase
+ *   double    period (s)
+ *   uint16_t  number of fields, then for each:
+ *     (uint16_t length, chars)  name
+ *     uint8_t   1 for the change since the last sample, 0 for a value
+ *     uint8_t   1 if the server had it, 0 if not
+ *     double    change or value
+ */
+class BinaryWriter : public Writer {
+    string _buf;
+
+    template<typename T>
+    void put(T x) {
+        _buf.append(reinterpret_cast<const char *>(&x), sizeof x);
+    }
+    void put(const string &s) {
+        put<uint16_t>(s.size());
+        _buf.append(s);
+    }
+    void put(const histogram::snapshot &s) {
+        for (size_t i = 0; i < sizeof quantiles / sizeof quantiles[0]; ++i) {
+            put<double>(usecs(s.quantile(quantiles[i])));
+        }
+        put<double>(usecs(s.max()));
+    }
+
+    void flush_record() {
+        const uint32_t size = _buf.size();
+        cout.write(reinterpret_cast<const char *>(&size), sizeof size);
+        cout.write(_buf.data(), _buf.size());
+    }
+
+  public:
+    void write(const Report &r, const ServerSample *server) {
+        for (auto it = r.records.begin(); it != r.records.end(); ++it) {
+            const Record &rec = *it;
+            _buf.clear();
+            put<uint8_t>(rec.total);
+            put(rec.phase);
+            put(rec.ns);
+            put(rec.type);
+            put<uint32_t>(rec.id);
+            put<double>(rec.period);
+            put<double>(rec.elapsed);
+            put<uint64_t>(rec.ops);
+            put<uint64_t>(rec.c_ops);
+            put<uint64_t>(rec.bytes);
+            put<uint64_t>(rec.c_bytes);
+            put<uint64_t>(rec.docs);
+            put<uint64_t>(rec.c_docs);
+            put<uint64_t>(rec.errors);
+            put<uint64_t>(rec.c_errors);
+            put<uint64_t>(rec.late.count());
+            put<uint64_t>(rec.c_late.count());
+            put(rec.latency);
+            put(rec.c_latency);
+            flush_record();
+        }
+        if (server != NULL) {
+            _buf.clear();
+            put<uint8_t>(2);
+            put(server->phase);
+            put<double>(server->period);
+            put<uint16_t>(server->stats.size());
+            for (auto it = server->stats.begin(); it != server->stats.end(); ++it) {
+                put(it->name);
+                put<uint8_t>(it->counter);
+                put<uint8_t>(it->ok);
+                put<double>(it->value);
+            }
+            flush_record();
+        }
+        cout.flush();
+    }
+};
+
+OutputFormat Reporter::format = OutputFormat::tsv;
+
+po::options_description Reporter::options_description() {
+    po::options_description desc("Reports");
+    desc.add_options()
+            ("output-format", po::value(&format)->default_value(format), "Format for stress reports: tsv, jsonl or binary.")
+            ;
+    return desc;
+}
+
+Reporter::Reporter() : _queue(1000), _thread(std::mem_fn(&Reporter::run), this) {}
+
+Reporter::~Reporter() {
+    finish();
+}
+
+void Reporter::finish() {
+    if (_thread.joinable()) {
+        _queue.push(shared_ptr<Report>());
+        _thread.join();
+    }
+}
+
+void Reporter::run() {
+    unique_ptr<Writer> w;
+    switch (format) {
+        case OutputFormat::jsonl:
+            w.reset(new JsonWriter);
+            break;
+        case OutputFormat::binary:
+            w.reset(new BinaryWriter);
+            break;
+        case OutputFormat::tsv:
+        default:
+            w.reset(new TsvWriter);
+            break;
+    }
+    while (true) {
+        shared_ptr<Report> r = _queue.front();
+        _queue.pop();
+        if (!r) {
+            break;
+        }
+        // Give the server a couple of intervals to answer before giving up on its sample.
+        ServerSample server;
+        const bool have_server = r->server.valid() &&
+                r->server.wait_for(std::chrono::duration<double>(std::max(2 * out::output_period, 1.0))) == std::future_status::ready;
+        if (have_server) {
+            server = r->server.get();
+        }
+        w->write(*r, have_server ? &server : NULL);
+    }
+}
+
+} // namespace cortisol
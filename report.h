@@ -0,0 +1,131 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "histogram.h"
+#include "queue.h"
+
+namespace cortisol {
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace po = boost::program_options;
+
+/** How interval reports are written to stdout. */
+enum class OutputFormat {
+    tsv,    // padded columns, for people (see --pad-output, --ofs, --ors)
+    jsonl,  // one JSON object per line
+    binary  // length-prefixed packed records, see BinaryWriter in report.cpp
+};
+
+std::istream &operator>>(std::istream &is, OutputFormat &f);
+std::ostream &operator<<(std::ostream &os, const OutputFormat &f);
+
+/**
+ * One runner's stats for one kind of operation over one reporting
+ * interval (or, for totals, the whole run).  The histograms are raw
+ * snapshots: turning them into percentiles is left to the writer thread.
+ */
+class Record {
+  public:
+    bool total;
+    string phase;
+    string ns;
+    string type;
+    size_t id;
+
+    double period;   // length of this interval (s), 0 for totals
+    double elapsed;  // since the start of the run (s)
+
+    uint64_t ops;
+    uint64_t c_ops;
+    uint64_t bytes;
+    uint64_t c_bytes;
+    uint64_t docs;   // documents returned by queries
+    uint64_t c_docs;
+    uint64_t errors;
+    uint64_t c_errors;
+
+    histogram::snapshot latency;
+    histogram::snapshot c_latency;
+    histogram::snapshot late;
+    histogram::snapshot c_late;
+
+    Record() : total(false), id(0), period(0), elapsed(0), ops(0), c_ops(0), bytes(0), c_bytes(0), docs(0), c_docs(0), errors(0), c_errors(0) {}
+};
+
+/** One serverStatus or collStats field, from a ServerSample. */
+class ServerStat {
+  public:
+    string name;   // dotted path, e.g. "ft.cachetable.miss.count"
+    bool counter;  // value is the change since the last sample, rather than the current value
+    bool ok;       // the server gave us this one this time
+    double value;
+
+    ServerStat() : counter(false), ok(false), value(0) {}
+};
+
+/** What the server said about itself at the same tick as an interval report.  See ServerStats. */
+class ServerSample {
+  public:
+    string phase;
+    double period;  // since the last sample (s)
+    vector<ServerStat> stats;
+
+    ServerSample() : period(0) {}
+};
+
+/** Everything reported at one tick. */
+class Report {
+  public:
+    bool header;  // print column headers first (tsv only)
+    bool totals;  // the final totals, rather than an interval
+    vector<Record> records;
+    std::shared_future<ServerSample> server;  // if we're sampling the server, filled in by ServerStats
+
+    Report() : header(false), totals(false) {}
+};
+
+/**
+ * Formats and writes Reports on a background thread, so the main thread
+ * only has to take snapshots, and never waits on stdout or on formatting
+ * hundreds of lines.
+ */
+class Reporter {
+    Queue<shared_ptr<Report> > _queue;
+    std::thread _thread;
+
+    void run();
+
+  public:
+    Reporter();
+    ~Reporter();
+    Reporter(const Reporter&) = delete;
+    Reporter& operator=(const Reporter&) = delete;
+
+    void push(const shared_ptr<Report> &r) {
+        _queue.push(r);
+    }
+
+    /** Writes everything pushed so far and stops the writer thread. */
+    void finish();
+
+    // config
+    static OutputFormat format;
+    static po::options_description options_description();
+};
+
+} // namespace cortisol
@@ -0,0 +1,61 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "timing.h"
+
+namespace cortisol {
+
+/**
+ * Small, fast PRNG (xorshift128+).  Unlike random(), it has no lock, so
+ * give each thread its own instead of sharing one.
+ */
+class rng {
+    uint64_t _s[2];
+
+    static uint64_t splitmix64(uint64_t &x) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+  public:
+    explicit rng(uint64_t seed) {
+        _s[0] = splitmix64(seed);
+        _s[1] = splitmix64(seed);
+    }
+
+    /** @return a seed that no other call in this process will return. */
+    static uint64_t fresh_seed() {
+        static std::atomic<uint64_t> n(0);
+        uint64_t x = now() ^ (n++ << 32);
+        return splitmix64(x);
+    }
+
+    uint64_t operator()() {
+        uint64_t s1 = _s[0];
+        const uint64_t s0 = _s[1];
+        const uint64_t result = s0 + s1;
+        _s[0] = s0;
+        s1 ^= s1 << 23;
+        _s[1] = s1 ^ s0 ^ (s1 >> 18) ^ (s0 >> 5);
+        return result;
+    }
+
+    /** @return a uniform integer in [0, n). */
+    uint64_t uniform(uint64_t n) {
+        return (uint64_t) (((unsigned __int128) (*this)() * n) >> 64);
+    }
+
+    /** @return a uniform real in [0, 1). */
+    double real() {
+        return ((*this)() >> 11) * (1.0 / (UINT64_C(1) << 53));
+    }
+};
+
+} // namespace cortisol
@@ -0,0 +1,150 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+
+#include "histogram.h"
+#include "output.h"
+#include "timing.h"
+
+namespace cortisol {
+
+/**
+ * Fixed timeline for open-loop load generation.
+ *
+ * A runner type's target rate is split evenly over its threads, and each
+ * thread's timeline is offset by its id so the threads interleave instead
+ * of all firing at once.  The intended start of each op only depends on
+ * the timeline, not on when the last op finished, so a stalled server
+ * shows up as latency rather than as fewer requests.
+ */
+class schedule {
+    timestamp_t _interval;
+    timestamp_t _offset;
+    timestamp_t _next;
+
+  public:
+    schedule() : _interval(0), _offset(0), _next(0) {}
+
+    /** Target rate ops/sec over nthreads threads, as seen by thread id.  A rate of 0 means closed loop. */
+    void reset(double rate, size_t nthreads, size_t id) {
+        if (rate <= 0 || nthreads == 0) {
+            _interval = 0;
+            _offset = 0;
+        } else {
+            _interval = secs_to_ts(nthreads / rate);
+            _offset = _interval * id / nthreads;
+        }
+        _next = 0;
+    }
+
+    bool open() const {
+        return _interval != 0;
+    }
+
+    /**
+     * Sleeps until the next op is due, or until running goes false.
+     * @return the op's intended start time.
+     */
+    timestamp_t wait(const bool &running) {
+        if (!open()) {
+            return now();
+        }
+        const timestamp_t intended = due();
+        for (timestamp_t t = now(); running && t < intended; t = now()) {
+            const double remaining = ts_to_secs(intended - t);
+            if (remaining > 0.002) {
+                // Sleep most of the way in short chunks so stop() is noticed, then spin.
+                usleep(std::min(remaining - 0.001, 0.1) * 1000000);
+            } else {
+                sched_yield();
+            }
+        }
+        advance();
+        return intended;
+    }
+
+    /** @return when the next op is due, without waiting for it (now, in a closed loop). */
+    timestamp_t due() {
+        if (!open()) {
+            return now();
+        }
+        if (_next == 0) {
+            _next = now() + _offset;
+        }
+        return _next;
+    }
+
+    /** Moves on from the op due() returned, once it's been started. */
+    void advance() {
+        if (open()) {
+            _next += _interval;
+        }
+    }
+};
+
+/**
+ * Report columns for how far behind schedule ops started, for open-loop
+ * runners: the # of late ops and their p99 lateness, for the interval and
+ * the whole run.  Only ops that were late go in the histogram.
+ */
+class lateness {
+  public:
+    class output_line {
+        bool _total;
+        histogram::snapshot _iteration;
+        histogram::snapshot _cumulative;
+
+        static double usecs(timestamp_t t) {
+            return ts_to_secs(t) * 1000000.0;
+        }
+
+      public:
+        output_line(const histogram::snapshot &iteration, const histogram::snapshot &cumulative) : _total(false), _iteration(iteration), _cumulative(cumulative) {}
+        output_line(const histogram::snapshot &cumulative) : _total(true), _cumulative(cumulative) {}
+
+        template<typename ostream_type>
+        friend inline ostream_type &operator<<(ostream_type &os, const output_line &line) {
+            using out::ofs;
+            typedef histogram::output_line::fmt fmt;
+
+            if (line._total) {
+                os << out::pad(10) << "       " << ofs
+                   << fmt() << "       " << ofs;
+            } else {
+                os << out::pad(10) << line._iteration.count() << ofs
+                   << fmt() << usecs(line._iteration.quantile(0.99)) << ofs;
+            }
+            os << out::pad(10) << line._cumulative.count() << ofs
+               << fmt() << usecs(line._cumulative.quantile(0.99));
+
+            return os;
+        }
+
+        class header {
+          public:
+            template<typename ostream_type>
+            friend inline ostream_type &operator<<(ostream_type &os, const header &h) {
+                using out::ofs;
+                typedef histogram::output_line::fmt fmt;
+
+                os << out::pad(10) << "i_late (#)" << ofs
+                   << fmt() << "i_qp99 (us)" << ofs
+                   << out::pad(10) << "c_late (#)" << ofs
+                   << fmt() << "c_qp99 (us)";
+                return os;
+            }
+        };
+    };
+
+    static output_line::header header() {
+        return output_line::header();
+    }
+};
+
+} // namespace cortisol
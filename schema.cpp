@@ -0,0 +1,78 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "schema.h"
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include "collection.h"
+
+namespace cortisol {
+
+using mongo::BSONObj;
+using mongo::BSONObjBuilder;
+using std::stringstream;
+
+const Schema *Schema::_instance = NULL;
+
+static void gen_field(size_t i, stringstream &ss) {
+    if (i < 26) {
+        ss << (char) ('a' + i);
+    } else {
+        gen_field(i / 26, ss);
+        gen_field(i % 26, ss);
+    }
+}
+
+/** @return the number of bits needed to write n. */
+static size_t bits(size_t n) {
+    size_t b = 0;
+    for (; n > 0; n >>= 1) {
+        ++b;
+    }
+    return b;
+}
+
+Schema::Schema(size_t nfields, size_t nindexes) {
+    // Index n uses field i for every bit i set in n, so make sure we have those too.
+    nfields = std::max(nfields, bits(nindexes));
+
+    vector<size_t> offsets;
+    for (size_t i = 0; i < nfields; ++i) {
+        stringstream ss;
+        gen_field(i, ss);
+        const string name = ss.str();
+        offsets.push_back(_names.size());
+        _names.insert(_names.end(), name.begin(), name.end());
+        _names.push_back('\0');
+    }
+    // Only take pointers once _names has stopped growing.
+    for (size_t i = 0; i < nfields; ++i) {
+        _fields.push_back(&_names[offsets[i]]);
+    }
+
+    for (size_t n = 0; n < nindexes; ++n) {
+        BSONObjBuilder b;
+        stringstream ss;
+        size_t bits = n;
+        // Always need at least one field, so keep this out of the loop.
+        b.append("a", (bits&1) ? -1 : 1);
+        ss << "a_" << ((bits&1) ? -1 : 1);
+        bits >>= 1;
+        for (size_t idx = 1; bits > 0; ++idx, bits >>= 1) {
+            b.append(_fields[idx], (bits&1) ? -1 : 1);
+            ss << "_" << _fields[idx] << "_" << ((bits&1) ? -1 : 1);
+        }
+        _index_specs.push_back(b.obj());
+        _index_names.push_back(ss.str());
+    }
+}
+
+void Schema::init() {
+    if (_instance == NULL) {
+        _instance = new Schema(Collection::fields, Collection::indexes);
+    }
+}
+
+} // namespace cortisol
@@ -0,0 +1,67 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <assert.h>
+
+#include <string>
+#include <vector>
+
+#include "mongo/client/dbclient.h"
+
+namespace cortisol {
+
+using std::string;
+using std::vector;
+
+/**
+ * Field names ("a", "b", ..., "z", "ba", ...) and index specs, built once
+ * before any thread starts and never changed afterwards, so the fill and
+ * runner threads can read them without locking or copying.
+ */
+class Schema {
+    vector<char> _names;            // all field names, NUL-terminated, back to back
+    vector<const char *> _fields;   // pointers into _names
+    vector<mongo::BSONObj> _index_specs;
+    vector<string> _index_names;
+
+    Schema(size_t nfields, size_t nindexes);
+
+  public:
+    Schema(const Schema&) = delete;
+    Schema& operator=(const Schema&) = delete;
+
+    /** Builds the table from Collection::fields and Collection::indexes.  Call from main() once options are parsed. */
+    static void init();
+
+    static const Schema &get() {
+        assert(_instance != NULL);
+        return *_instance;
+    }
+
+    size_t fields() const {
+        return _fields.size();
+    }
+    const char *field(size_t i) const {
+        assert(i < _fields.size());
+        return _fields[i];
+    }
+
+    size_t indexes() const {
+        return _index_specs.size();
+    }
+    /** @return the key pattern for the nth index, defined by interpreting the bits in n. */
+    const mongo::BSONObj &index_spec(size_t n) const {
+        assert(n < _index_specs.size());
+        return _index_specs[n];
+    }
+    const string &index_name(size_t n) const {
+        assert(n < _index_names.size());
+        return _index_names[n];
+    }
+
+  private:
+    static const Schema *_instance;
+};
+
+} // namespace cortisol
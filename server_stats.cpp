@@ -0,0 +1,178 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "server_stats.h"
+
+#include <iostream>
+#include <sstream>
+
+namespace cortisol {
+
+using std::cerr;
+using std::endl;
+
+bool ServerStats::enabled = false;
+string ServerStats::counters = "network.bytesIn,network.bytesOut,"
+        "opcounters.query,opcounters.insert,opcounters.update,opcounters.delete,"
+        "globalLock.lockTime,"
+        "ft.cachetable.miss.count,ft.cachetable.miss.time,"
+        "ft.checkpoint.count,ft.checkpoint.time,"
+        "ft.fsync.count,ft.fsync.time,"
+        "ft.alerts.longWaitEvents.cachePressure.count,ft.alerts.longWaitEvents.cachePressure.time,"
+        "ft.alerts.longWaitEvents.locktreeWait.count,ft.alerts.longWaitEvents.locktreeWait.time";
+string ServerStats::gauges = "connections.current,globalLock.currentQueue.total,"
+        "ft.cachetable.size.current,ft.locktree.size.current,ft.alerts.locktreeRequestsPending";
+bool ServerStats::coll_stats = true;
+po::options_description ServerStats::options_description() {
+    po::options_description desc("Server Stats");
+    desc.add_options()
+            ("server_stats",            po::value(&enabled)->default_value(enabled),       "Sample serverStatus at every report, and report what changed next to the client's numbers.")
+            ("server_stats.counters",   po::value(&counters)->default_value(counters),     "serverStatus fields to report the change in, comma separated.")
+            ("server_stats.gauges",     po::value(&gauges)->default_value(gauges),         "serverStatus fields to report the value of, comma separated.")
+            ("server_stats.coll_stats", po::value(&coll_stats)->default_value(coll_stats), "Also report count, size, storageSize and totalIndexSize from collStats, summed over the stressed collections.")
+            ;
+    return desc;
+}
+
+static const char *coll_fields[] = {"count", "size", "storageSize", "totalIndexSize"};
+static const string coll_prefix = "colls.";
+
+static void add_fields(const string &list, bool counter, vector<ServerStat> &stats) {
+    std::stringstream ss(list);
+    string name;
+    while (std::getline(ss, name, ',')) {
+        if (name.empty()) {
+            continue;
+        }
+        ServerStat s;
+        s.name = name;
+        s.counter = counter;
+        stats.push_back(s);
+    }
+}
+
+ServerStats::ServerStats(const Options &opts, const vector<string> &namespaces) : _opts(opts), _namespaces(namespaces), _have_last(false), _last_t(0), _requests(1000) {
+    add_fields(counters, true, _last);
+    add_fields(gauges, false, _last);
+    if (coll_stats) {
+        for (size_t i = 0; i < sizeof coll_fields / sizeof coll_fields[0]; ++i) {
+            ServerStat s;
+            s.name = coll_prefix + coll_fields[i];
+            _last.push_back(s);
+        }
+    }
+    _thread = std::thread(&ServerStats::run, this);
+}
+
+ServerStats::~ServerStats() {
+    _requests.push(Request());
+    _thread.join();
+}
+
+std::shared_future<ServerSample> ServerStats::sample(const string &phase) {
+    Request r;
+    r.phase = phase;
+    r.promise.reset(new std::promise<ServerSample>);
+    std::shared_future<ServerSample> f = r.promise->get_future().share();
+    _requests.push(r);
+    return f;
+}
+
+bool ServerStats::read(vector<ServerStat> &stats) {
+    try {
+        if (!_conn) {
+            string errmsg;
+            mongo::ConnectionString cs = mongo::ConnectionString::parse(_opts.host, errmsg);
+            if (cs.isValid()) {
+                _conn.reset(cs.connect(errmsg));
+            }
+            if (!_conn) {
+                cerr << "server stats: couldn't connect to " << _opts.host << ": " << errmsg << endl;
+                return false;
+            }
+        }
+        mongo::BSONObj status;
+        if (!_conn->runCommand("admin", BSON("serverStatus" << 1), status)) {
+            cerr << "server stats: serverStatus failed: " << status.toString() << endl;
+            return false;
+        }
+        vector<double> colls(sizeof coll_fields / sizeof coll_fields[0], 0);
+        bool colls_ok = coll_stats;
+        for (auto it = _namespaces.begin(); colls_ok && it != _namespaces.end(); ++it) {
+            const size_t dot = it->find('.');
+            mongo::BSONObj res;
+            if (!_conn->runCommand(it->substr(0, dot), BSON("collStats" << it->substr(dot + 1)), res)) {
+                colls_ok = false;
+                break;
+            }
+            for (size_t i = 0; i < colls.size(); ++i) {
+                colls[i] += res[coll_fields[i]].numberDouble();
+            }
+        }
+
+        stats = _last;
+        for (auto it = stats.begin(); it != stats.end(); ++it) {
+            if (it->name.compare(0, coll_prefix.size(), coll_prefix) == 0) {
+                const string field = it->name.substr(coll_prefix.size());
+                for (size_t i = 0; i < colls.size(); ++i) {
+                    if (field == coll_fields[i]) {
+                        it->ok = colls_ok;
+                        it->value = colls[i];
+                    }
+                }
+                continue;
+            }
+            mongo::BSONElement e = status.getFieldDotted(it->name);
+            it->ok = e.isNumber();
+            it->value = it->ok ? e.numberDouble() : 0;
+        }
+        return true;
+    } catch (const mongo::DBException &e) {
+        cerr << "server stats: " << e.what() << endl;
+        _conn.reset();
+        return false;
+    }
+}
+
+void ServerStats::run() {
+    // The first sample is the baseline for the first interval's counters.
+    // Every sample has every field in _last, in the same order, so the
+    // columns never change under the header; one the server doesn't have
+    // just isn't ok.
+    vector<ServerStat> stats;
+    while (true) {
+        if (!_have_last && read(stats)) {
+            _last = stats;
+            _last_t = now();
+            _have_last = true;
+        }
+
+        Request r = _requests.front();
+        _requests.pop();
+        if (!r.promise) {
+            break;
+        }
+        ServerSample s;
+        s.phase = r.phase;
+        const timestamp_t t = now();
+        if (_have_last && read(stats)) {
+            s.period = ts_to_secs(t - _last_t);
+            s.stats = stats;
+            for (size_t i = 0; i < stats.size(); ++i) {
+                if (stats[i].counter) {
+                    s.stats[i].ok = stats[i].ok && _last[i].ok;
+                    s.stats[i].value = stats[i].value - _last[i].value;
+                }
+            }
+            _last = stats;
+            _last_t = t;
+        } else {
+            s.stats = _last;
+            for (auto it = s.stats.begin(); it != s.stats.end(); ++it) {
+                it->ok = false;
+            }
+        }
+        r.promise->set_value(s);
+    }
+}
+
+} // namespace cortisol
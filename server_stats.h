@@ -0,0 +1,87 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "mongo/client/dbclient.h"
+
+#include "options.h"
+#include "queue.h"
+#include "report.h"
+#include "timing.h"
+
+namespace cortisol {
+
+namespace po = boost::program_options;
+
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+/**
+ * Samples the server alongside the client's interval reports, so a dip
+ * in throughput can be lined up with a checkpoint, an eviction storm or a
+ * pile of lock waits.
+ *
+ * A thread with its own connection runs serverStatus (and collStats on
+ * each stressed collection, summed) whenever sample() is called, which
+ * the report loop does at the same tick as it snapshots the runners.  The
+ * sample comes back as a future on the Report, and the Reporter waits for
+ * it, so the report loop never waits on the server.  Counters are
+ * reported as the change since the last sample.  Every sample has the
+ * same fields, fixed when we're constructed; ones the server doesn't have
+ * (TokuMX's ft section on a vanilla mongod, say) aren't ok, so they show
+ * up as "-" or null rather than moving the columns around.
+ */
+class ServerStats {
+    class Request {
+      public:
+        string phase;
+        shared_ptr<std::promise<ServerSample> > promise;  // none to stop
+    };
+
+    const Options &_opts;
+    const vector<string> _namespaces;
+    unique_ptr<mongo::DBClientBase> _conn;
+    vector<ServerStat> _last;  // the fields we report, as of the last sample
+    bool _have_last;
+    timestamp_t _last_t;
+    Queue<Request> _requests;
+    std::thread _thread;
+
+    /** Reads every field in _last into stats.  @return false if we couldn't reach the server. */
+    bool read(vector<ServerStat> &stats);
+    void run();
+
+  public:
+    /** Starts sampling the server at opts.host, with collStats on namespaces. */
+    ServerStats(const Options &opts, const vector<string> &namespaces);
+    ~ServerStats();
+    ServerStats(const ServerStats&) = delete;
+    ServerStats& operator=(const ServerStats&) = delete;
+
+    /** Samples the server now, for the report taken in phase at this tick. */
+    std::shared_future<ServerSample> sample(const string &phase);
+
+    /** @return whether to sample: --server_stats is on and there's a server. */
+    static bool wanted(const Options &opts) {
+        return enabled && opts.backend == BackendType::mongo;
+    }
+
+    // config
+    static bool enabled;
+    static string counters;
+    static string gauges;
+    static bool coll_stats;
+    static po::options_description options_description();
+};
+
+} // namespace cortisol
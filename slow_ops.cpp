@@ -0,0 +1,142 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "slow_ops.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace cortisol {
+
+using std::cerr;
+using std::endl;
+using std::stringstream;
+
+double SlowOps::slow_ms = 100;
+string SlowOps::sample_file;
+size_t SlowOps::samples_per_sec = 10;
+po::options_description SlowOps::options_description() {
+    po::options_description desc("Slow Operations");
+    desc.add_options()
+            ("slow_ms",          po::value(&slow_ms)->default_value(slow_ms),                 "Log ops that take longer than this many ms (0 = off).")
+            ("slow_sample_file", po::value(&sample_file)->default_value(sample_file),         "Append slow ops, with their requests, to this file as JSON lines.")
+            ("slow_samples",     po::value(&samples_per_sec)->default_value(samples_per_sec), "Max # of slow ops written to slow_sample_file per second.")
+            ;
+    return desc;
+}
+
+timestamp_t SlowOps::threshold() {
+    return slow_ms > 0 ? std::max<timestamp_t>(secs_to_ts(slow_ms / 1000.0), 1) : 0;
+}
+
+void SlowOps::sample(const string &ns, const string &op, long long key, timestamp_t elapsed, const mongo::BSONObj &request) {
+    // sample_file is only read once threads are running, so a failed open is remembered here instead.
+    static std::atomic<bool> unwritable(false);
+    if (sample_file.empty() || unwritable.load(std::memory_order_relaxed)) {
+        return;
+    }
+    static std::mutex mutex;
+    static std::ofstream file;
+    static timestamp_t second_start = 0;
+    static size_t in_second = 0;
+
+    const timestamp_t t = now();
+    std::lock_guard<std::mutex> lk(mutex);
+    if (unwritable.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (t - second_start >= secs_to_ts(1.0)) {
+        second_start = t;
+        in_second = 0;
+    }
+    if (in_second >= samples_per_sec) {
+        return;
+    }
+    ++in_second;
+    if (!file.is_open()) {
+        file.open(sample_file.c_str(), std::ios_base::app);
+        if (!file) {
+            cerr << "can't open " << sample_file << ", not sampling slow ops" << endl;
+            unwritable.store(true, std::memory_order_relaxed);
+            return;
+        }
+    }
+    file << "{\"ns\":\"" << ns << "\""
+         << ",\"op\":\"" << op << "\"";
+    if (key >= 0) {
+        file << ",\"key\":" << key;
+    }
+    file << ",\"elapsed_ms\":" << ts_to_nsecs(elapsed) / 1000000.0;
+    if (!request.isEmpty()) {
+        file << ",\"request\":" << request.jsonString();
+    }
+    file << "}" << endl;
+}
+
+SlowOpWatchdog::SlowOpWatchdog(const vector<const op_watch *> &watches) : _threshold(SlowOps::threshold()), _done(false) {
+    if (_threshold == 0) {
+        return;
+    }
+    for (auto it = watches.begin(); it != watches.end(); ++it) {
+        entry e;
+        e.watch = *it;
+        e.reported = 0;
+        _watches.push_back(e);
+    }
+    _thread = std::thread(&SlowOpWatchdog::run, this);
+}
+
+SlowOpWatchdog::~SlowOpWatchdog() {
+    if (!_thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lk(_mutex);
+        _done = true;
+        _cond.notify_all();
+    }
+    _thread.join();
+}
+
+void SlowOpWatchdog::scan() {
+    const timestamp_t t = now();
+    for (auto it = _watches.begin(); it != _watches.end(); ++it) {
+        const op_watch &w = *it->watch;
+        const timestamp_t start = w.start.load(std::memory_order_acquire);
+        if (start == 0 || start == it->reported || start > t || t - start < _threshold) {
+            continue;
+        }
+        const string *op = w.op.load(std::memory_order_relaxed);
+        const long long key = w.key.load(std::memory_order_relaxed);
+        // If the op finished (and maybe another started) while we looked, what we read may be mixed up.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (w.start.load(std::memory_order_relaxed) != start) {
+            continue;
+        }
+        it->reported = start;
+
+        stringstream ss;
+        ss << "slow op: " << *w.ns << " " << (op ? *op : string("?"));
+        if (key >= 0) {
+            ss << " key " << key;
+        }
+        ss << " running for " << std::fixed << std::setprecision(1) << ts_to_nsecs(t - start) / 1000000.0 << " ms" << endl;
+        cerr << ss.str();
+    }
+}
+
+void SlowOpWatchdog::run() {
+    // Look often enough that an op is caught within a quarter of the threshold of becoming slow.
+    const double period_ms = std::min(std::max(SlowOps::slow_ms / 4, 1.0), 100.0);
+    const auto period = std::chrono::microseconds(static_cast<long long>(period_ms * 1000));
+    std::unique_lock<std::mutex> lk(_mutex);
+    while (!_done) {
+        _cond.wait_for(lk, period);
+        scan();
+    }
+}
+
+} // namespace cortisol
@@ -0,0 +1,95 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "mongo/client/dbclient.h"
+
+#include "aligned.h"
+#include "timing.h"
+
+namespace cortisol {
+
+namespace po = boost::program_options;
+
+using std::string;
+using std::vector;
+
+/**
+ * What one runner thread is doing right now, for the SlowOpWatchdog.  The
+ * runner writes it with plain stores at the start and end of every op,
+ * on a cache line of its own; the watchdog only reads it.
+ */
+class op_watch {
+  public:
+    alignas(cache_line_size) std::atomic<timestamp_t> start;  // 0 between ops
+    std::atomic<const string *> op;
+    std::atomic<long long> key;  // -1 if the op has none
+    const string *ns;
+
+    op_watch() : start(0), op(NULL), key(-1), ns(NULL) {}
+
+    void begin(timestamp_t t, const string *opname) {
+        key.store(-1, std::memory_order_relaxed);
+        op.store(opname, std::memory_order_relaxed);
+        start.store(t, std::memory_order_release);
+    }
+    void end() {
+        start.store(0, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Slow operation reporting.  The watchdog logs ops that have been running
+ * for more than slow_ms, while they're still stuck; runners themselves
+ * append slow ops, with the request they sent, to slow_sample_file once
+ * they finish.
+ */
+class SlowOps {
+  public:
+    /** @return slow_ms in ticks, or 0 if slow op reporting is off. */
+    static timestamp_t threshold();
+
+    /** Appends a slow op to slow_sample_file, unless there is none or this second's samples are used up.  Thread safe. */
+    static void sample(const string &ns, const string &op, long long key, timestamp_t elapsed, const mongo::BSONObj &request);
+
+    // config
+    static double slow_ms;
+    static string sample_file;
+    static size_t samples_per_sec;
+    static po::options_description options_description();
+};
+
+/** Scans a set of op_watches from a thread of its own, for as long as it exists. */
+class SlowOpWatchdog {
+    class entry {
+      public:
+        const op_watch *watch;
+        timestamp_t reported;  // start of the last op we logged, so each is logged once
+    };
+
+    vector<entry> _watches;
+    const timestamp_t _threshold;
+    bool _done;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::thread _thread;
+
+    void scan();
+    void run();
+
+  public:
+    /** Does nothing if slow op reporting is off. */
+    explicit SlowOpWatchdog(const vector<const op_watch *> &watches);
+    ~SlowOpWatchdog();
+};
+
+} // namespace cortisol
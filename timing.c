@@ -1,94 +1,102 @@
 /* -*- mode: C; c-file-style: "Google"; c-basic-offset: 4 -*- */
 
-#include <errno.h>
+#include "timing.h"
+
+#include <cpuid.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
-#include <inttypes.h>
 #include <stdlib.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <string.h>
+#include <time.h>
 
+int timing_source_ = TIMING_UNINITIALIZED;
+double timing_secs_per_tick_;
+double timing_ticks_per_sec_;
+uint64_t timing_ns_mult_;
 
-static int get_processor_frequency_sys(uint64_t *hzret) {
-    int r;
-    FILE *fp = fopen("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq", "r");
-    if (!fp)  {
-        r = errno;
-    } else {
-        unsigned int khz = 0;
-        if (fscanf(fp, "%u", &khz) == 1) {
-            *hzret = khz * 1000ULL;
-            r = 0;
-        } else {
-            r = ENOENT;
-        }
-        fclose(fp);
-    }
-    return r;
+static pthread_once_t timing_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return (uint64_t)hi << 32 | lo;
 }
 
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** @return whether CPUID says the TSC is invariant (constant_tsc and nonstop_tsc in /proc/cpuinfo). */
+static int tsc_invariant(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return 0;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return (edx >> 8) & 1;
+}
 
-static int get_processor_frequency_cpuinfo(uint64_t *hzret) {
-    int r;
-    FILE *fp = fopen("/proc/cpuinfo", "r");
+/** @return whether the kernel is timekeeping with the TSC, or we can't tell. */
+static int kernel_trusts_tsc(void) {
+    FILE *fp = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
     if (!fp) {
-        r = errno;
-    } else {
-        uint64_t maxhz = 0;
-        char *buf = NULL;
-        size_t n = 0;
-        while (getline(&buf, &n, fp) >= 0) {
-            unsigned int cpu;
-            sscanf(buf, "processor : %u", &cpu);
-            unsigned int ma, mb;
-            if (sscanf(buf, "cpu MHz : %u.%u", &ma, &mb) == 2) {
-                uint64_t hz = ma * 1000000ULL + mb * 1000ULL;
-                if (hz > maxhz) {
-                    maxhz = hz;
-                }
-            }
-        }
-        if (buf) {
-            free(buf);
-        }
-        fclose(fp);
-        *hzret = maxhz;
-        r = maxhz == 0 ? ENOENT : 0;;
+        return 1;
     }
+    char buf[64] = "";
+    int r = fgets(buf, sizeof buf, fp) == NULL || strncmp(buf, "tsc", 3) == 0;
+    fclose(fp);
     return r;
 }
 
+/**
+ * Reads the TSC and CLOCK_MONOTONIC_RAW at (nearly) the same moment: the
+ * TSC read is bracketed by two clock reads, and the tightest of a few
+ * tries is kept.
+ */
+static void sample(uint64_t *tsc, uint64_t *ns) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 5; ++i) {
+        uint64_t a = clock_ns(CLOCK_MONOTONIC_RAW);
+        uint64_t t = rdtsc();
+        uint64_t b = clock_ns(CLOCK_MONOTONIC_RAW);
+        if (b - a < best) {
+            best = b - a;
+            *tsc = t;
+            *ns = a + (b - a) / 2;
+        }
+    }
+}
 
-static int get_processor_frequency_sysctl(const char * const cmd, uint64_t *hzret) {
-    int r = 0;
-    FILE *fp = popen(cmd, "r");
-    if (!fp) {
-        r = EINVAL;  // popen doesn't return anything useful in errno,
-                     // gotta pick something
-        goto exit;
+/** @return TSC ticks per second, measured over about 50ms. */
+static double calibrate_tsc(void) {
+    uint64_t tsc0, ns0, tsc1, ns1;
+    sample(&tsc0, &ns0);
+    struct timespec nap = {0, 50 * 1000 * 1000};
+    while (nanosleep(&nap, &nap) != 0) {
     }
-    r = fscanf(fp, "%" SCNu64, hzret);
-    if (r != 1) {
-        r = errno;
+    sample(&tsc1, &ns1);
+    return (tsc1 - tsc0) * 1e9 / (ns1 - ns0);
+}
+
+static void timing_init_once(void) {
+    int source;
+    double hz;
+    if (getenv("CORTISOL_NO_TSC") == NULL && tsc_invariant() && kernel_trusts_tsc()) {
+        source = TIMING_TSC;
+        hz = calibrate_tsc();
     } else {
-        r = 0;
+        source = TIMING_CLOCK_GETTIME;
+        hz = 1e9;
     }
-    pclose(fp);
-
-exit:
-    return r;
+    timing_ticks_per_sec_ = hz;
+    timing_secs_per_tick_ = 1.0 / hz;
+    timing_ns_mult_ = (uint64_t) (1e9 / hz * 4294967296.0);
+    __atomic_store_n(&timing_source_, source, __ATOMIC_RELEASE);
 }
 
-
-int get_processor_frequency(uint64_t *hzret) {
-    int r;
-    r = get_processor_frequency_sys(hzret);
-    if (r != 0)
-        r = get_processor_frequency_cpuinfo(hzret);
-    if (r != 0)
-        r = get_processor_frequency_sysctl("sysctl -n hw.cpufrequency", hzret);
-    if (r != 0)
-        r = get_processor_frequency_sysctl("sysctl -n machdep.tsc_freq", hzret);
-    return r;
+void timing_init(void) {
+    pthread_once(&timing_once, timing_init_once);
 }
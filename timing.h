@@ -7,27 +7,69 @@ extern "C" {
 #endif
 
 
+#include <assert.h>
 #include <stdint.h>
-
-int get_processor_frequency(uint64_t *hzret);
+#include <time.h>
 
 typedef unsigned long long timestamp_t;
 
+/**
+ * Where timestamps come from.  The TSC is only used if the CPU says it
+ * ticks at a constant rate through frequency changes and sleep states
+ * (invariant TSC), and the kernel trusts it as its own clocksource, which
+ * it doesn't when the TSCs of different sockets disagree.  Its rate is
+ * then measured against CLOCK_MONOTONIC_RAW, not guessed from the CPU's
+ * nominal frequency.  Otherwise timestamps are CLOCK_MONOTONIC
+ * nanoseconds, which is still cheap through the vDSO.
+ */
+typedef enum {
+    TIMING_UNINITIALIZED = 0,
+    TIMING_TSC,
+    TIMING_CLOCK_GETTIME
+} timing_source_t;
+
+extern int timing_source_;
+extern double timing_secs_per_tick_;
+extern double timing_ticks_per_sec_;
+extern uint64_t timing_ns_mult_;  // ns per tick, as a 32.32 fixed point number
+
+/** Picks and calibrates the clock.  Thread safe, and only does anything the first time; now() calls it if needed. */
+void timing_init(void);
+
+/** @return the clock in use, initializing it if need be. */
+static inline timing_source_t timing_source(void) {
+    int s = __atomic_load_n(&timing_source_, __ATOMIC_ACQUIRE);
+    if (__builtin_expect(s == TIMING_UNINITIALIZED, 0)) {
+        timing_init();
+        s = __atomic_load_n(&timing_source_, __ATOMIC_ACQUIRE);
+    }
+    return (timing_source_t) s;
+}
+
 static inline timestamp_t now(void) {
-    uint32_t lo, hi;
-    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
-    return (timestamp_t)hi << 32 | lo;
+    if (__builtin_expect(timing_source() == TIMING_TSC, 1)) {
+        uint32_t lo, hi;
+        __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+        return (timestamp_t)hi << 32 | lo;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (timestamp_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 static inline double ts_to_secs(timestamp_t ts) {
-    static double seconds_per_clock = -1;
-    if (seconds_per_clock<0) {
-	uint64_t hz;
-	int r = get_processor_frequency(&hz);
-	assert(r == 0);
-	seconds_per_clock = 1.0/hz;
-    }
-    return ts * seconds_per_clock;
+    timing_source();
+    return ts * timing_secs_per_tick_;
+}
+
+static inline uint64_t ts_to_nsecs(timestamp_t ts) {
+    timing_source();
+    return (uint64_t) (((unsigned __int128) ts * timing_ns_mult_) >> 32);
+}
+
+static inline timestamp_t secs_to_ts(double secs) {
+    timing_source();
+    return secs * timing_ticks_per_sec_;
 }
 
 #if defined(__cplusplus)
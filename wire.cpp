@@ -0,0 +1,109 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#include "wire.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+namespace cortisol {
+namespace wire {
+
+void Reader::need(size_t n) const {
+    if ((size_t) (_end - _p) < n) {
+        throw std::runtime_error("truncated message");
+    }
+}
+
+int32_t Reader::int32() {
+    int32_t x;
+    need(sizeof x);
+    memcpy(&x, _p, sizeof x);
+    _p += sizeof x;
+    return x;
+}
+
+int64_t Reader::int64() {
+    int64_t x;
+    need(sizeof x);
+    memcpy(&x, _p, sizeof x);
+    _p += sizeof x;
+    return x;
+}
+
+const char *Reader::cstring() {
+    const char *s = _p;
+    const char *nul = static_cast<const char *>(memchr(_p, '\0', _end - _p));
+    if (nul == NULL) {
+        throw std::runtime_error("truncated message");
+    }
+    _p = nul + 1;
+    return s;
+}
+
+mongo::BSONObj Reader::doc() {
+    int32_t size;
+    need(sizeof size);
+    memcpy(&size, _p, sizeof size);
+    if (size < 5) {
+        throw std::runtime_error("bad document size");
+    }
+    need(size);
+    mongo::BSONObj o(_p);
+    _p += size;
+    return o;
+}
+
+/** @return false at EOF before anything was read. */
+static bool read_all(int fd, char *p, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = read(fd, p + done, n - done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            if (done == 0 && r == 0) {
+                return false;
+            }
+            throw std::runtime_error("connection closed mid-message");
+        }
+        done += r;
+    }
+    return true;
+}
+
+bool read_message(int fd, string &msg) {
+    Header h;
+    if (!read_all(fd, reinterpret_cast<char *>(&h), sizeof h)) {
+        return false;
+    }
+    if (h.length < (int32_t) header_size || h.length > max_message_size) {
+        throw std::runtime_error("bad message length");
+    }
+    msg.resize(h.length);
+    memcpy(&msg[0], &h, sizeof h);
+    if (h.length > (int32_t) header_size && !read_all(fd, &msg[header_size], h.length - header_size)) {
+        throw std::runtime_error("connection closed mid-message");
+    }
+    return true;
+}
+
+bool write_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return false;
+        }
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+} // namespace wire
+} // namespace cortisol
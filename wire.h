@@ -0,0 +1,121 @@
+/* -*- mode: C++; c-file-style: "Google"; c-basic-offset: 4 -*- */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "mongo/client/dbclient.h"
+
+namespace cortisol {
+
+using std::string;
+
+/**
+ * Just enough of the MongoDB wire protocol to talk to cortisol without the
+ * driver: message framing, and reading and writing the fields of the
+ * legacy opcodes.  Everything is little endian on the wire, like the hosts
+ * we run on, so fields are copied as they are.
+ */
+namespace wire {
+
+enum Op {
+    op_reply = 1,
+    op_update = 2001,
+    op_insert = 2002,
+    op_query = 2004,
+    op_get_more = 2005,
+    op_delete = 2006,
+    op_kill_cursors = 2007
+};
+
+// OP_QUERY flags
+static const int32_t query_exhaust = 1 << 6;
+// OP_REPLY flags
+static const int32_t reply_cursor_not_found = 1 << 0;
+static const int32_t reply_query_failure = 1 << 1;
+// OP_DELETE flags
+static const int32_t delete_single = 1 << 0;
+
+static const size_t header_size = 16;
+static const int32_t max_message_size = 48 << 20;
+
+class Header {
+  public:
+    int32_t length;
+    int32_t request_id;
+    int32_t response_to;
+    int32_t op;
+};
+
+/** Builds one message.  Call finish() before sending data(). */
+class Builder {
+    string _buf;
+
+  public:
+    Builder(Op op, int32_t request_id, int32_t response_to) {
+        Header h = {0, request_id, response_to, op};
+        _buf.append(reinterpret_cast<const char *>(&h), sizeof h);
+    }
+
+    void int32(int32_t x) {
+        _buf.append(reinterpret_cast<const char *>(&x), sizeof x);
+    }
+    void int64(int64_t x) {
+        _buf.append(reinterpret_cast<const char *>(&x), sizeof x);
+    }
+    void cstring(const string &s) {
+        _buf.append(s.c_str(), s.size() + 1);
+    }
+    void doc(const mongo::BSONObj &o) {
+        _buf.append(o.objdata(), o.objsize());
+    }
+
+    /** Fills in the length.  @return the message. */
+    const string &finish() {
+        const int32_t length = _buf.size();
+        memcpy(&_buf[0], &length, sizeof length);
+        return _buf;
+    }
+};
+
+/**
+ * Reads the fields of a message body in order.  Documents are views into
+ * the message, valid as long as it is.  Reading past the end throws.
+ */
+class Reader {
+    const char *_p;
+    const char *_end;
+
+    void need(size_t n) const;
+
+  public:
+    Reader(const char *body, size_t len) : _p(body), _end(body + len) {}
+
+    bool more() const {
+        return _p < _end;
+    }
+    int32_t int32();
+    int64_t int64();
+    const char *cstring();
+    mongo::BSONObj doc();
+};
+
+/** Reads one whole message from fd into msg, header included.  @return false at EOF. */
+bool read_message(int fd, string &msg);
+/** @return false if the connection broke. */
+bool write_all(int fd, const char *p, size_t n);
+
+inline const Header &header(const string &msg) {
+    return *reinterpret_cast<const Header *>(msg.data());
+}
+
+inline Reader body(const string &msg) {
+    return Reader(msg.data() + header_size, msg.size() - header_size);
+}
+
+} // namespace wire
+
+} // namespace cortisol